@@ -119,23 +119,390 @@ void crc32_calc_dw(u32* pCrcAccum, u32* pVal)
 
 }
 
-void crc32_calc_buffer(u32* pCrcAccum, u32* num_crc, const u8* buffer, u32 len)
+/*
+ * The original byte by byte loop, reference for the faster kernels below
+ */
+static u32 crc32_calc_bytewise(u32 accum, const u8* buffer, u32 len)
 {
-	if (len > 0)
+	u32 i;
+
+	for (i = 0; i < len; ++i)
 	{
-		int i;
-		u32 accum = *pCrcAccum;
+		u8 tbIdx = ((accum >>24) ^ buffer[i]) & 0xff;
+		accum = ( accum << 8) ^ crc32_table[tbIdx];
+	}
+
+	return accum;
+}
+
+/*
+ * Slice-by-16: crc32_slice_table[k][b] is the CRC of byte b followed by k
+ * zero bytes, so 16 bytes are processed with 16 independent lookups.
+ * crc32_slice_table[0] is crc32_table.
+ */
+static u32 crc32_slice_table[16][256];
+
+static u32 crc32_calc_table(u32 accum, const u8* buffer, u32 len)
+{
+	const u32 (*t)[256] = crc32_slice_table;
+
+	/* 16 bytes at once */
+	for (; len >= 16; len -= 16, buffer += 16)
+	{
+		u32 x = accum ^ (((u32) buffer[0] << 24) | ((u32) buffer[1] << 16)
+				| ((u32) buffer[2] << 8) | buffer[3]);
+
+		accum = t[15][x >> 24] ^ t[14][(x >> 16) & 0xff]
+			^ t[13][(x >> 8) & 0xff] ^ t[12][x & 0xff]
+			^ t[11][buffer[4]] ^ t[10][buffer[5]]
+			^ t[9][buffer[6]] ^ t[8][buffer[7]]
+			^ t[7][buffer[8]] ^ t[6][buffer[9]]
+			^ t[5][buffer[10]] ^ t[4][buffer[11]]
+			^ t[3][buffer[12]] ^ t[2][buffer[13]]
+			^ t[1][buffer[14]] ^ t[0][buffer[15]];
+	}
+
+	/* The rest byte by byte */
+	return crc32_calc_bytewise(accum, buffer, len);
+}
+
+/*
+ * Carry-less multiply folding.
+ *
+ * The accumulator after a message M of n bytes, starting from S, is
+ * (S * x^(8n) + M * x^32) mod P. 64 byte blocks are kept in four 128 bit
+ * lanes (first byte in the most significant bits) and each lane is moved
+ * 512 bits further with x^512 mod P and x^576 mod P. The lanes are then
+ * folded into one with the 128 bit constants; the remaining 128 bit value
+ * is reduced by running it through the table with a zero accumulator.
+ */
+#define CRC32_FOLD_MIN      64
+
+enum
+{
+	CRC32_K128 = 0,
+	CRC32_K192,
+	CRC32_K512,
+	CRC32_K576,
+	CRC32_K_NUM
+};
+
+static u64 crc32_fold_k[CRC32_K_NUM];
+
+typedef u32 (*crc32_kernel_t)(u32 accum, const u8* buffer, u32 len);
+
+static crc32_kernel_t crc32_kernel = crc32_calc_table;
+
+/* x^n mod P */
+static u64 crc32_xpow_mod(u32 n)
+{
+	u32 r = 1;
+
+	while (n-- > 0)
+		r = (r << 1) ^ ((r & 0x80000000u) ? 0x04c11db7u : 0);
+
+	return r;
+}
+
+static u32 crc32_reduce128(u64 hi, u64 lo)
+{
+	u8 tmp[16];
+	int i;
+
+	for (i = 0; i < 8; ++i)
+	{
+		tmp[i] = (u8) (hi >> (56 - 8 * i));
+		tmp[8 + i] = (u8) (lo >> (56 - 8 * i));
+	}
+
+	return crc32_calc_table(0, tmp, sizeof(tmp));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define CRC32_HAVE_CLMUL
+
+#define CRC32_CLMUL_LOAD(p) \
+	_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p)), bswap)
+
+#define CRC32_CLMUL_FOLD(x, k, b) \
+	_mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128((x), (k), 0x11), \
+			_mm_clmulepi64_si128((x), (k), 0x00)), (b))
+
+__attribute__((target("pclmul,ssse3")))
+static u32 crc32_calc_clmul(u32 accum, const u8* buffer, u32 len)
+{
+	const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+			7, 6, 5, 4, 3, 2, 1, 0);
+	const __m128i k128 = _mm_set_epi64x(crc32_fold_k[CRC32_K192],
+			crc32_fold_k[CRC32_K128]);
+	const __m128i k512 = _mm_set_epi64x(crc32_fold_k[CRC32_K576],
+			crc32_fold_k[CRC32_K512]);
+	__m128i x0, x1, x2, x3;
+	u64 lanes[2];
+
+	if (len < CRC32_FOLD_MIN)
+		return crc32_calc_table(accum, buffer, len);
+
+	x0 = _mm_xor_si128(CRC32_CLMUL_LOAD(buffer),
+			_mm_set_epi32((int) accum, 0, 0, 0));
+	x1 = CRC32_CLMUL_LOAD(buffer + 16);
+	x2 = CRC32_CLMUL_LOAD(buffer + 32);
+	x3 = CRC32_CLMUL_LOAD(buffer + 48);
+
+	for (buffer += 64, len -= 64; len >= 64; buffer += 64, len -= 64)
+	{
+		x0 = CRC32_CLMUL_FOLD(x0, k512, CRC32_CLMUL_LOAD(buffer));
+		x1 = CRC32_CLMUL_FOLD(x1, k512, CRC32_CLMUL_LOAD(buffer + 16));
+		x2 = CRC32_CLMUL_FOLD(x2, k512, CRC32_CLMUL_LOAD(buffer + 32));
+		x3 = CRC32_CLMUL_FOLD(x3, k512, CRC32_CLMUL_LOAD(buffer + 48));
+	}
+
+	x0 = CRC32_CLMUL_FOLD(x0, k128, x1);
+	x0 = CRC32_CLMUL_FOLD(x0, k128, x2);
+	x0 = CRC32_CLMUL_FOLD(x0, k128, x3);
+
+	for (; len >= 16; buffer += 16, len -= 16)
+		x0 = CRC32_CLMUL_FOLD(x0, k128, CRC32_CLMUL_LOAD(buffer));
+
+	_mm_storeu_si128((__m128i*) lanes, x0);
+	accum = crc32_reduce128(lanes[1], lanes[0]);
+
+	return crc32_calc_table(accum, buffer, len);
+}
+
+static int crc32_cpu_has_clmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+}
+
+/*
+ * The PMULL kernel has not been through a compiler yet; it stays off
+ * unless the build asks for it with -DCRC32_AARCH64_PMULL.
+ */
+#elif defined(__aarch64__) && defined(__linux__) && defined(CRC32_AARCH64_PMULL)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+#define CRC32_HAVE_CLMUL
+
+/* Big endian load: byte 0 ends up in the top of lane 1 */
+__attribute__((target("+crypto")))
+static inline uint64x2_t crc32_pmull_load(const u8* p)
+{
+	uint64x2_t v = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(p)));
+	return vextq_u64(v, v, 1);
+}
+
+#define CRC32_CLMUL_LOAD(p) crc32_pmull_load(p)
+
+#define CRC32_CLMUL_FOLD(x, khi, klo, b) \
+	veorq_u64(veorq_u64( \
+			vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64((x), 1), (khi))), \
+			vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64((x), 0), (klo)))), \
+			(b))
+
+__attribute__((target("+crypto")))
+static u32 crc32_calc_clmul(u32 accum, const u8* buffer, u32 len)
+{
+	const poly64_t k128 = crc32_fold_k[CRC32_K128];
+	const poly64_t k192 = crc32_fold_k[CRC32_K192];
+	const poly64_t k512 = crc32_fold_k[CRC32_K512];
+	const poly64_t k576 = crc32_fold_k[CRC32_K576];
+	uint64x2_t x0, x1, x2, x3;
 
-		for (i = 0; i < len; ++i)
+	if (len < CRC32_FOLD_MIN)
+		return crc32_calc_table(accum, buffer, len);
+
+	x0 = veorq_u64(CRC32_CLMUL_LOAD(buffer),
+			vcombine_u64(vcreate_u64(0), vcreate_u64((u64) accum << 32)));
+	x1 = CRC32_CLMUL_LOAD(buffer + 16);
+	x2 = CRC32_CLMUL_LOAD(buffer + 32);
+	x3 = CRC32_CLMUL_LOAD(buffer + 48);
+
+	for (buffer += 64, len -= 64; len >= 64; buffer += 64, len -= 64)
+	{
+		x0 = CRC32_CLMUL_FOLD(x0, k576, k512, CRC32_CLMUL_LOAD(buffer));
+		x1 = CRC32_CLMUL_FOLD(x1, k576, k512, CRC32_CLMUL_LOAD(buffer + 16));
+		x2 = CRC32_CLMUL_FOLD(x2, k576, k512, CRC32_CLMUL_LOAD(buffer + 32));
+		x3 = CRC32_CLMUL_FOLD(x3, k576, k512, CRC32_CLMUL_LOAD(buffer + 48));
+	}
+
+	x0 = CRC32_CLMUL_FOLD(x0, k192, k128, x1);
+	x0 = CRC32_CLMUL_FOLD(x0, k192, k128, x2);
+	x0 = CRC32_CLMUL_FOLD(x0, k192, k128, x3);
+
+	for (; len >= 16; buffer += 16, len -= 16)
+		x0 = CRC32_CLMUL_FOLD(x0, k192, k128, CRC32_CLMUL_LOAD(buffer));
+
+	accum = crc32_reduce128(vgetq_lane_u64(x0, 1), vgetq_lane_u64(x0, 0));
+
+	return crc32_calc_table(accum, buffer, len);
+}
+
+static int crc32_cpu_has_clmul(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+
+#endif
+
+/*
+ * Combining: crc32_x2n[k] is x^(2^k) mod P, so x^n mod P is the product of
+ * the entries for the bits set in n.
+ */
+static u32 crc32_x2n[64 + 3];
+
+/* a * b mod P */
+static u32 crc32_mulmod(u32 a, u32 b)
+{
+	u32 r = 0;
+	int i;
+
+	for (i = 31; i >= 0; --i)
+	{
+		r = (r << 1) ^ ((r & 0x80000000u) ? 0x04c11db7u : 0);
+		if (b & (1u << i))
+			r ^= a;
+	}
+
+	return r;
+}
+
+u32 crc32_calc_combine(u32 crc1, u32 crc2, u64 len2)
+{
+	int k;
+
+	/* crc1 * x^(8 * len2) */
+	for (k = 3; len2 != 0; len2 >>= 1, ++k)
+	{
+		if (len2 & 1)
+			crc1 = crc32_mulmod(crc1, crc32_x2n[k]);
+	}
+
+	return crc1 ^ crc2;
+}
+
+u32 crc32_update_range(u32 crc, u32 size, u32 offset, const u8* old_data, const u8* new_data, u32 len)
+{
+	u8 delta[256];
+	u32 accum = 0;
+	u32 num_crc = 0;
+	u32 done, i, value;
+	u64 shift;
+
+	/* The CRC is linear: only the difference matters */
+	for (done = 0; done < len; done += i)
+	{
+		for (i = 0; i < sizeof(delta) && done + i < len; ++i)
+			delta[i] = old_data[done + i] ^ new_data[done + i];
+
+		crc32_calc_buffer(&accum, &num_crc, delta, i);
+	}
+
+	/* Moved past the rest of the buffer and the size bytes of crc32_calc_dw() */
+	shift = (u64) size - offset - len;
+	for (value = size; value != 0; value >>= 8)
+		++shift;
+
+	return crc ^ crc32_calc_combine(accum, 0, shift);
+}
+
+/*
+ * Known answer check of a kernel: the fixed vector "123456789", and the byte
+ * by byte loop for every alignment and for lengths around the 16 and 64 byte
+ * blocks. The digest of all results is fixed too, so a wrong table can't
+ * pass on both sides. A kernel is only used if all of them match.
+ */
+#define CRC32_CHECK_ACCUM   0x89A1897Fu /* "123456789", accumulator started at 0 */
+#define CRC32_CHECK_CKSUM   0x377A6011u /* Same, finished by crc32_calc_dw() (as cksum) */
+#define CRC32_CHECK_DIGEST  0x7C93A6DEu /* Results of the pattern below, rotated by 5 and xored */
+
+static int crc32_check_kernel(crc32_kernel_t kernel)
+{
+	static const u8 check[9] = "123456789";
+	u8 pattern[512];
+	u32 seed = 0x12345678;
+	u32 digest = 0;
+	u32 crc, size = sizeof(check);
+	u32 off, len;
+
+	crc = kernel(0, check, sizeof(check));
+	if (crc != CRC32_CHECK_ACCUM)
+		return 0;
+
+	crc32_calc_dw(&crc, &size);
+	if (crc != CRC32_CHECK_CKSUM)
+		return 0;
+
+	for (len = 0; len < sizeof(pattern); ++len)
+	{
+		seed = seed * 1103515245u + 12345u;
+		pattern[len] = (u8) (seed >> 16);
+	}
+
+	for (off = 0; off < 16; ++off)
+	{
+		for (len = 0; len + off <= sizeof(pattern); len += (len < 160) ? 1 : 61)
 		{
-			u8 tbIdx = ((accum >>24) ^ buffer[i]) & 0xff;
-			accum = ( accum << 8) ^ crc32_table[tbIdx];
-			*pCrcAccum = accum;
+			crc = kernel(seed, pattern + off, len);
+			if (crc != crc32_calc_bytewise(seed, pattern + off, len))
+				return 0;
+
+			digest = ((digest << 5) | (digest >> 27)) ^ crc;
 		}
-		*num_crc += len;
 	}
 
+	return digest == CRC32_CHECK_DIGEST;
 }
 
+__attribute__((constructor)) static void crc32_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; ++i)
+	{
+		crc32_slice_table[0][i] = crc32_table[i];
+
+		for (k = 1; k < 16; ++k)
+		{
+			u32 prev = crc32_slice_table[k - 1][i];
+			crc32_slice_table[k][i] = (prev << 8) ^ crc32_table[prev >> 24];
+		}
+	}
+
+	for (i = 0; i < 64 + 3; ++i)
+		crc32_x2n[i] = (i == 0) ? 2 : crc32_mulmod(crc32_x2n[i - 1], crc32_x2n[i - 1]);
+
+	crc32_fold_k[CRC32_K128] = crc32_xpow_mod(128);
+	crc32_fold_k[CRC32_K192] = crc32_xpow_mod(192);
+	crc32_fold_k[CRC32_K512] = crc32_xpow_mod(512);
+	crc32_fold_k[CRC32_K576] = crc32_xpow_mod(576);
+
+	/* The fastest kernel that passes, the byte by byte loop otherwise */
+	if (!crc32_check_kernel(crc32_calc_table))
+		crc32_kernel = crc32_calc_bytewise;
 
+#ifdef CRC32_HAVE_CLMUL
+	if (crc32_cpu_has_clmul() && crc32_check_kernel(crc32_calc_clmul))
+		crc32_kernel = crc32_calc_clmul;
+#endif
+}
 
+void crc32_calc_buffer(u32* pCrcAccum, u32* num_crc, const u8* buffer, u32 len)
+{
+	if (len > 0)
+	{
+		*num_crc += len;
+		*pCrcAccum = crc32_kernel(*pCrcAccum, buffer, len);
+	}
+
+}
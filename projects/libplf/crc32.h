@@ -29,6 +29,19 @@
 
 void crc32_calc_dw(u32* pCrcAccum, u32* pVal);
 void crc32_calc_buffer(u32* pCrcAccum, u32* num_crc,  const u8* buffer, u32 len);
+/*
+ * Accumulator of A followed by B, from the accumulator of A (any start
+ * value) and the accumulator of B started at 0, B having len2 bytes.
+ * Use it before crc32_calc_dw(), with the size counters added up.
+ * Not crc32_combine(): that is zlib's (reflected CRC), libplf links zlib.
+ */
+u32  crc32_calc_combine(u32 crc1, u32 crc2, u64 len2);
+/*
+ * Finished CRC (see crc32_calc_dw()) of a buffer of size bytes, after len
+ * bytes at offset changed from old_data to new_data. Costs O(len), not
+ * O(size).
+ */
+u32  crc32_update_range(u32 crc, u32 size, u32 offset, const u8* old_data, const u8* new_data, u32 len);
 
 
 #endif /* CRC32_H_ */
@@ -23,9 +23,66 @@
  *  along with libplf.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <zlib.h>
 #include "types.h"
 
+#if !defined(__WIN32__)
+# include <pthread.h>
+# define GZ_PARALLEL
+#endif
+
+#define GZ_OUT_CHUNK   0x8000
+#define GZ_BLOCK_SIZE  0x20000   /* Input of a block of the parallel compressor */
+#define GZ_DICT_SIZE   0x8000    /* Window of deflate, the end of a block primes the next one */
+#define GZ_OS_UNIX     3
+
+typedef int (*gz_out_func)(void* arg, const u8* data, u32 len);
+
+/*
+ * Block of the parallel compressor. Blocks are raw deflate data ending on
+ * a byte boundary (Z_SYNC_FLUSH, the last one Z_FINISH), so they can be
+ * joined to one gzip member.
+ */
+typedef struct s_gz_block_tag
+{
+    u8*             in;           // GZ_DICT_SIZE bytes of dictionary, followed by the input
+    u32             dict_len;     // Used part of the dictionary (at its end)
+    u32             in_len;       // Bytes of input
+    u8*             out;          // Compressed data
+    u32             out_size;     // Allocated size of out
+    u32             out_len;      // Bytes of compressed data
+    u32             crc;          // crc32() of the input
+    int             last;         // Last block of the stream
+    int             done;         // Compressed, ready to be written
+    int             error;        // zlib error
+} s_gz_block;
+
+typedef struct s_gz_stream_tag
+{
+    z_stream        zs;           // Single stream, used if not compressed in blocks
+    int             zs_init;      // zs is initialized
+    int             level;        // Compression level
+    int             nthreads;     // Threads of the parallel compressor, 1: single stream
+#ifdef GZ_PARALLEL
+    s_gz_block*     blocks;       // Ring of nblocks blocks, block n is in slot n % nblocks
+    u32             nblocks;
+    int             filling;      // Block num_filled takes input
+    u64             num_filled;   // Blocks handed to the threads
+    u64             num_taken;    // Blocks taken by a thread
+    u64             num_written;  // Blocks passed to out()
+    u32             crc;          // crc32() of the blocks written
+    u32             isize;        // Input size of the blocks written (mod 2^32)
+    pthread_t*      threads;
+    int             num_running;  // Threads started
+    int             shutdown;     // Threads have to exit
+    pthread_mutex_t lock;
+    pthread_cond_t  cond_work;    // Block filled or shutdown
+    pthread_cond_t  cond_done;    // Block compressed
+#endif
+} s_gz_stream;
+
 int  gz_uncompress (u8 *dest, u32 *destLen, const u8 *source, u32 sourceLen)
 {
     z_stream stream;
@@ -58,3 +115,391 @@ int  gz_uncompress (u8 *dest, u32 *destLen, const u8 *source, u32 sourceLen)
     err = inflateEnd(&stream);
     return err;
 }
+
+/*
+ * Streaming compression to the gzip format read by gz_uncompress().
+ * The compressed data is passed to out() as soon as it is available.
+ * With nthreads > 1 data of more than one block is compressed in blocks
+ * on nthreads threads (like pigz), smaller data is compressed as one
+ * stream. out() is always called from the thread calling gz_compress().
+ */
+void* gz_compress_begin(int level, int nthreads)
+{
+    s_gz_stream* stream;
+
+    stream = (s_gz_stream*) calloc(1, sizeof(s_gz_stream));
+    if (stream == 0) return 0;
+
+    stream->level = level;
+    stream->nthreads = (nthreads > 1) ? nthreads : 1;
+
+#ifdef GZ_PARALLEL
+    if (stream->nthreads > 1) {
+        stream->nblocks = 2 * stream->nthreads;
+        stream->blocks = (s_gz_block*) calloc(stream->nblocks, sizeof(s_gz_block));
+        stream->threads = (pthread_t*) calloc(stream->nthreads, sizeof(pthread_t));
+
+        if (stream->blocks == 0 || stream->threads == 0) {
+            free(stream->blocks);
+            free(stream->threads);
+            free(stream);
+            return 0;
+        }
+
+        pthread_mutex_init(&stream->lock, 0);
+        pthread_cond_init(&stream->cond_work, 0);
+        pthread_cond_init(&stream->cond_done, 0);
+    }
+#else
+    stream->nthreads = 1;
+#endif
+
+    return stream;
+}
+
+static int gz_compress_single (s_gz_stream* stream, const u8 *source, u32 sourceLen, int finish, gz_out_func out, void* arg)
+{
+    u8 buffer[GZ_OUT_CHUNK];
+    u32 have;
+    int err;
+
+    if (!stream->zs_init) {
+        if (deflateInit2(&stream->zs, stream->level, Z_DEFLATED, 16+MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return Z_MEM_ERROR;
+        stream->zs_init = 1;
+    }
+
+    stream->zs.next_in = (Bytef*)source;
+    stream->zs.avail_in = (uInt)sourceLen;
+
+    for (;;) {
+        stream->zs.next_out = buffer;
+        stream->zs.avail_out = sizeof(buffer);
+
+        err = deflate(&stream->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR) return err;
+
+        have = sizeof(buffer) - stream->zs.avail_out;
+        if (have > 0 && out(arg, buffer, have) < 0) return Z_ERRNO;
+
+        /* Without finish zlib keeps what doesn't fill the output buffer */
+        if (finish ? (err == Z_STREAM_END) : (stream->zs.avail_out != 0)) break;
+    }
+
+    return Z_OK;
+}
+
+#ifdef GZ_PARALLEL
+/*
+ * Compress a block with the raw deflate stream zs of a thread
+ */
+static void gz_compress_block (z_stream* zs, s_gz_block* block)
+{
+    u8* out;
+    int err;
+
+    block->crc = crc32(0L, block->in + GZ_DICT_SIZE, block->in_len);
+    block->out_len = 0;
+
+    err = deflateReset(zs);
+    if (err == Z_OK && block->dict_len > 0)
+        err = deflateSetDictionary(zs, block->in + GZ_DICT_SIZE - block->dict_len, block->dict_len);
+    if (err != Z_OK) {
+        block->error = err;
+        return;
+    }
+
+    zs->next_in = block->in + GZ_DICT_SIZE;
+    zs->avail_in = block->in_len;
+
+    for (;;) {
+        zs->next_out = block->out + block->out_len;
+        zs->avail_out = block->out_size - block->out_len;
+
+        err = deflate(zs, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+        block->out_len = block->out_size - zs->avail_out;
+        if (err == Z_STREAM_ERROR) {
+            block->error = err;
+            return;
+        }
+
+        /* Flushed completely if output space is left */
+        if (zs->avail_out != 0 && (block->last ? (err == Z_STREAM_END) : (zs->avail_in == 0))) break;
+
+        /* Incompressible data, more space needed */
+        out = (u8*) realloc(block->out, block->out_size * 2);
+        if (out == 0) {
+            block->error = Z_MEM_ERROR;
+            return;
+        }
+        block->out = out;
+        block->out_size *= 2;
+    }
+}
+
+static void* gz_compress_thread (void* arg)
+{
+    s_gz_stream* stream = (s_gz_stream*) arg;
+    s_gz_block* block;
+    z_stream zs;
+    int err;
+
+    memset(&zs, 0, sizeof(zs));
+    err = deflateInit2(&zs, stream->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+
+    pthread_mutex_lock(&stream->lock);
+    for (;;) {
+        while (!stream->shutdown && stream->num_taken == stream->num_filled)
+            pthread_cond_wait(&stream->cond_work, &stream->lock);
+
+        if (stream->num_taken == stream->num_filled) break;
+
+        block = &stream->blocks[stream->num_taken++ % stream->nblocks];
+        pthread_mutex_unlock(&stream->lock);
+
+        if (err == Z_OK)
+            gz_compress_block(&zs, block);
+        else
+            block->error = err;
+
+        pthread_mutex_lock(&stream->lock);
+        block->done = 1;
+        pthread_cond_broadcast(&stream->cond_done);
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    if (err == Z_OK)
+        deflateEnd(&zs);
+
+    return 0;
+}
+
+static void gz_put_le32 (u8* dst, u32 val)
+{
+    dst[0] = (u8) val;
+    dst[1] = (u8) (val >> 8);
+    dst[2] = (u8) (val >> 16);
+    dst[3] = (u8) (val >> 24);
+}
+
+/*
+ * Write the compressed blocks in order: those before block upto are
+ * waited for, later ones only written if they are already done.
+ */
+static int gz_write_blocks (s_gz_stream* stream, u64 upto, gz_out_func out, void* arg)
+{
+    u8 header[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, GZ_OS_UNIX };
+    s_gz_block* block;
+    int done;
+
+    while (stream->num_written < stream->num_filled) {
+        block = &stream->blocks[stream->num_written % stream->nblocks];
+
+        pthread_mutex_lock(&stream->lock);
+        while (!block->done && stream->num_written < upto)
+            pthread_cond_wait(&stream->cond_done, &stream->lock);
+        done = block->done;
+        pthread_mutex_unlock(&stream->lock);
+
+        if (!done) break;
+        if (block->error != Z_OK) return block->error;
+
+        if (stream->num_written == 0) {
+            header[8] = (stream->level == 9) ? 2 : ((stream->level == 1) ? 4 : 0);
+            if (out(arg, header, sizeof(header)) < 0) return Z_ERRNO;
+        }
+
+        if (block->out_len > 0 && out(arg, block->out, block->out_len) < 0) return Z_ERRNO;
+
+        stream->crc = crc32_combine(stream->crc, block->crc, block->in_len);
+        stream->isize += block->in_len;
+        stream->num_written++;
+    }
+
+    return Z_OK;
+}
+
+/*
+ * Hand the block being filled to the threads
+ */
+static void gz_fill_block (s_gz_stream* stream, int last)
+{
+    s_gz_block* block = &stream->blocks[stream->num_filled % stream->nblocks];
+    z_stream zs;
+
+    block->last = last;
+    block->done = 0;
+    block->error = Z_OK;
+    stream->filling = 0;
+
+    pthread_mutex_lock(&stream->lock);
+    stream->num_filled++;
+    pthread_cond_signal(&stream->cond_work);
+
+    /* Threads are started with the first blocks */
+    if (stream->num_running < stream->nthreads
+            && pthread_create(&stream->threads[stream->num_running], 0, gz_compress_thread, stream) == 0) {
+        stream->num_running++;
+    }
+
+    if (stream->num_running > 0) {
+        pthread_mutex_unlock(&stream->lock);
+        return;
+    }
+
+    /* No thread, compress it here */
+    stream->num_taken++;
+    pthread_mutex_unlock(&stream->lock);
+
+    memset(&zs, 0, sizeof(zs));
+    block->error = deflateInit2(&zs, stream->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    if (block->error == Z_OK) {
+        gz_compress_block(&zs, block);
+        deflateEnd(&zs);
+    }
+    block->done = 1;
+}
+
+/*
+ * Start to fill the next block, once its slot is written. The dictionary
+ * is the end of the previous block.
+ */
+static int gz_next_block (s_gz_stream* stream, gz_out_func out, void* arg)
+{
+    s_gz_block* block = &stream->blocks[stream->num_filled % stream->nblocks];
+    s_gz_block* prev;
+    int err;
+
+    if (stream->num_filled >= stream->nblocks) {
+        err = gz_write_blocks(stream, stream->num_filled - stream->nblocks + 1, out, arg);
+        if (err != Z_OK) return err;
+    }
+
+    if (block->in == 0) {
+        block->in = (u8*) malloc(GZ_DICT_SIZE + GZ_BLOCK_SIZE);
+        block->out = (u8*) malloc(GZ_BLOCK_SIZE);
+        block->out_size = GZ_BLOCK_SIZE;
+
+        if (block->in == 0 || block->out == 0) return Z_MEM_ERROR;
+    }
+
+    block->dict_len = 0;
+    if (stream->num_filled > 0) {
+        prev = &stream->blocks[(stream->num_filled - 1) % stream->nblocks];
+        block->dict_len = (prev->in_len < GZ_DICT_SIZE) ? prev->in_len : GZ_DICT_SIZE;
+        memcpy(block->in + GZ_DICT_SIZE - block->dict_len,
+                prev->in + GZ_DICT_SIZE + prev->in_len - block->dict_len, block->dict_len);
+    }
+
+    block->in_len = 0;
+    stream->filling = 1;
+
+    return Z_OK;
+}
+
+static int gz_compress_parallel (s_gz_stream* stream, const u8 *source, u32 sourceLen, int finish, gz_out_func out, void* arg)
+{
+    s_gz_block* block = &stream->blocks[stream->num_filled % stream->nblocks];
+    u8 trailer[8];
+    u32 len;
+    int err;
+
+    while (sourceLen > 0) {
+        /* A full block is only handed over with more data, the last one is finished */
+        if (stream->filling && block->in_len == GZ_BLOCK_SIZE) {
+            gz_fill_block(stream, 0);
+
+            err = gz_write_blocks(stream, 0, out, arg);
+            if (err != Z_OK) return err;
+        }
+
+        if (!stream->filling) {
+            err = gz_next_block(stream, out, arg);
+            if (err != Z_OK) return err;
+            block = &stream->blocks[stream->num_filled % stream->nblocks];
+        }
+
+        len = GZ_BLOCK_SIZE - block->in_len;
+        if (len > sourceLen) len = sourceLen;
+
+        memcpy(block->in + GZ_DICT_SIZE + block->in_len, source, len);
+        block->in_len += len;
+        source += len;
+        sourceLen -= len;
+    }
+
+    if (!finish) return Z_OK;
+
+    /* Up to one block: a single stream, no threads */
+    if (stream->num_filled == 0) {
+        if (!stream->filling) return gz_compress_single(stream, 0, 0, 1, out, arg);
+        return gz_compress_single(stream, block->in + GZ_DICT_SIZE, block->in_len, 1, out, arg);
+    }
+
+    if (!stream->filling) {
+        err = gz_next_block(stream, out, arg);
+        if (err != Z_OK) return err;
+    }
+
+    gz_fill_block(stream, 1);
+
+    err = gz_write_blocks(stream, stream->num_filled, out, arg);
+    if (err != Z_OK) return err;
+
+    gz_put_le32(trailer, stream->crc);
+    gz_put_le32(trailer + 4, stream->isize);
+    if (out(arg, trailer, sizeof(trailer)) < 0) return Z_ERRNO;
+
+    return Z_OK;
+}
+#endif
+
+int  gz_compress (void* handle, const u8 *source, u32 sourceLen, int finish, gz_out_func out, void* arg)
+{
+    s_gz_stream* stream = (s_gz_stream*) handle;
+
+#ifdef GZ_PARALLEL
+    if (stream->nthreads > 1)
+        return gz_compress_parallel(stream, source, sourceLen, finish, out, arg);
+#endif
+
+    return gz_compress_single(stream, source, sourceLen, finish, out, arg);
+}
+
+void gz_compress_end(void* handle)
+{
+    s_gz_stream* stream = (s_gz_stream*) handle;
+#ifdef GZ_PARALLEL
+    u32 i;
+#endif
+
+    if (stream == 0) return;
+
+#ifdef GZ_PARALLEL
+    if (stream->nthreads > 1) {
+        pthread_mutex_lock(&stream->lock);
+        stream->shutdown = 1;
+        pthread_cond_broadcast(&stream->cond_work);
+        pthread_mutex_unlock(&stream->lock);
+
+        for (i = 0; i < (u32) stream->num_running; ++i)
+            pthread_join(stream->threads[i], 0);
+
+        for (i = 0; i < stream->nblocks; ++i) {
+            free(stream->blocks[i].in);
+            free(stream->blocks[i].out);
+        }
+
+        pthread_mutex_destroy(&stream->lock);
+        pthread_cond_destroy(&stream->cond_work);
+        pthread_cond_destroy(&stream->cond_done);
+        free(stream->blocks);
+        free(stream->threads);
+    }
+#endif
+
+    if (stream->zs_init)
+        deflateEnd(&stream->zs);
+
+    free(stream);
+}
@@ -24,10 +24,20 @@
  */
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/stat.h>
+#ifndef __WIN32__
+# include <sys/mman.h>
+# include <pthread.h>
+#endif
+#ifdef __linux__
+# include <sys/sendfile.h>
+# include <sys/syscall.h>
+#endif
 #include "plf_int.h"
 
 #ifdef __WIN32__
@@ -36,20 +46,91 @@
 # define F_O_BINARY 0
 #endif
 
+#ifdef IOV_MAX
+# define PLF_IOV_MAX IOV_MAX
+#else
+# define PLF_IOV_MAX 1024
+#endif
+
+#ifdef __WIN32__
+/* No positional I/O available, emulate it (not thread-safe) */
+static int plf_pread(int fd, void* buf, u32 len, u64 offset)
+{
+    if (lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    return read(fd, buf, len);
+}
+
+static int plf_pwrite(int fd, const void* buf, u32 len, u64 offset)
+{
+    if (lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    return write(fd, buf, len);
+}
+
+static s64 plf_pwritev(int fd, const struct iovec* iov, int iovcnt, u64 offset)
+{
+    s64 bytes_written = 0;
+    int i;
+
+    if (lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+
+    for (i = 0; i < iovcnt; ++i)
+    {
+        int ret_val = write(fd, iov[i].iov_base, iov[i].iov_len);
+
+        if (ret_val < 0)
+            return (bytes_written > 0) ? bytes_written : ret_val;
+
+        bytes_written += ret_val;
+
+        if (ret_val < iov[i].iov_len)
+            break;
+    }
+
+    return bytes_written;
+}
+#else
+# define plf_pread(fd, buf, len, offset)  pread((fd), (buf), (len), (offset))
+# define plf_pwrite(fd, buf, len, offset) pwrite((fd), (buf), (len), (offset))
+# define plf_pwritev(fd, iov, iovcnt, offset) pwritev((fd), (iov), (iovcnt), (offset))
+#endif
+
 /* From gzip.c */
+typedef int (*gz_out_func)(void* arg, const u8* data, u32 len);
 int  gz_uncompress (u8 *dest, u32 *destLen, const u8 *source, u32 sourceLen);
+void* gz_compress_begin(int level, int nthreads);
+int  gz_compress (void* handle, const u8 *source, u32 sourceLen, int finish, gz_out_func out, void* arg);
+void gz_compress_end(void* handle);
 
 /* Locals */
 
-static int plf_int_new_file();
-static int plf_int_read(int fileIdx, void* dst, u32 offset, u32 len);
-static int plf_int_write(int fileIdx, const void* src, u32 offset, u32 len);
-static int plf_int_open_file(int fileIdx);
-static int plf_int_read_entries(int fileIdx);
-static int plf_int_add_entry(int fileIdx, const s_plf_section* section, u32 offset);
-static s_plf_section_entry* plf_int_get_section(int fileIdx, int sectIdx);
+static int plf_int_new_file(s_plf_ctx* ctx);
+static s_plf_file_entry* plf_int_get_file(s_plf_ctx* ctx, int fileIdx);
+static s64 plf_int_read(s_plf_ctx* ctx, int fileIdx, void* dst, u64 offset, u64 len);
+static int plf_int_write(s_plf_ctx* ctx, int fileIdx, const void* src, u64 offset, u32 len);
+static int plf_int_flush(s_plf_ctx* ctx, int fileIdx);
+static int plf_int_writev(int fd, struct iovec* iov, int iovcnt, u64 offset);
+static s64 plf_int_copy_fd(int fd_in, u64 off_in, int fd_out, s64 off_out, u64 len);
+static int plf_int_open_file(s_plf_ctx* ctx, int fileIdx);
+static int plf_int_create(s_plf_ctx* ctx, int fileIdx);
+static int plf_int_map_file(s_plf_ctx* ctx, int fileIdx);
+static int plf_int_read_entries(s_plf_ctx* ctx, int fileIdx, u32 sectIdx);
+static int plf_int_add_entry(s_plf_ctx* ctx, int fileIdx, const s_plf_section* section, u64 offset);
+static s_plf_section* plf_int_get_section(s_plf_ctx* ctx, int fileIdx, int sectIdx);
+static void plf_int_get_idx_key(const struct stat* file_stat, s_plf_idx_key* key);
+static int plf_int_load_index(s_plf_ctx* ctx, int fileIdx);
+static int plf_int_calc_crc(s_plf_ctx* ctx, int fileIdx, int sectIdx, int split, u32* crc);
+static int plf_int_check_crc(s_plf_ctx* ctx, int fileIdx, int sectIdx, int split);
+static s64 plf_int_extract_verified(s_plf_ctx* ctx, int fileIdx, int sectIdx, int fd);
+#ifndef __WIN32__
+static int plf_int_num_cpus(void);
+#endif
+static int plf_int_calc_crc_part(s_plf_ctx* ctx, int fileIdx, int sectIdx, u32 offset, u32 len, u32* crc);
 
-static s_plf_file_entry plf_files[PLF_MAX_ALLOWED_FILES];
+static s_plf_ctx plf_default_ctx = { { 0, 0, 0, -1 }, 0 };
+static u32 plf_idx_tmp_counter = 0;     /* Names of temporary index files, see plf_ctx_write_index */
 
 static const s_plf_version_info plf_lib_version = {
         .major = PLF_LIB_VERSION_MAJOR,
@@ -67,11 +148,89 @@ const s_plf_version_info* plf_lib_get_version(void)
 }
 
 
+/*
+ * New context with its own set of files
+ */
+s_plf_ctx* plf_ctx_create(void)
+{
+    s_plf_ctx* ctx = (s_plf_ctx*) malloc(sizeof(s_plf_ctx));
+
+    if (ctx == 0)
+        return 0;
+
+    ctx->pool.files = 0;
+    ctx->pool.num_slots = 0;
+    ctx->pool.max_slots = 0;
+    ctx->pool.free_slot = -1;
+    ctx->idx_dir = 0;
+
+    return ctx;
+}
+
+/*
+ * Close all files of the context and free it
+ */
+int plf_ctx_destroy(s_plf_ctx* ctx)
+{
+    u32 slot;
+
+    if (ctx == 0 || ctx == &plf_default_ctx)
+        return PLF_E_PARAM;
+
+    for (slot = 0; slot < ctx->pool.num_slots; ++slot)
+    {
+        s_plf_file_entry* fileEntry = ctx->pool.files[slot];
+
+        if (fileEntry->flags & PLF_FILE_FLAG_INUSE)
+            plf_ctx_close(ctx, PLF_HANDLE(slot, fileEntry->generation));
+
+        free(fileEntry);
+    }
+
+    free(ctx->pool.files);
+    free(ctx->idx_dir);
+    free(ctx);
+
+    return 0;
+}
+
+
+
+/*
+ * Keep the indexes of files opened with PLF_OPEN_INDEX in dir
+ */
+int plf_ctx_set_index_dir(s_plf_ctx* ctx, const char* dir)
+{
+    char* new_dir = 0;
+
+    if (ctx == 0)
+        return PLF_E_PARAM;
+
+    if (dir != 0)
+    {
+        new_dir = strdup(dir);
+        if (new_dir == 0)
+            return PLF_E_MEM;
+    }
+
+    free(ctx->idx_dir);
+    ctx->idx_dir = new_dir;
+
+    return 0;
+}
 
 /*
  * Open a file fom the file system
  */
-int plf_open_file(const char* filename)
+int plf_ctx_open_file(s_plf_ctx* ctx, const char* filename)
+{
+    return plf_ctx_open_file_ex(ctx, filename, 0);
+}
+
+/*
+ * Open a file fom the file system, flags see PLF_OPEN_xxx
+ */
+int plf_ctx_open_file_ex(s_plf_ctx* ctx, const char* filename, u32 flags)
 {
     int fileIdx;
     s_plf_file_entry* fileEntry;
@@ -80,30 +239,89 @@ int plf_open_file(const char* filename)
         return PLF_E_PARAM;
 
     /* Reserve a new file */
-    fileIdx = plf_int_new_file();
+    fileIdx = plf_int_new_file(ctx);
     if (fileIdx < 0)
         return fileIdx;
 
-    fileEntry = &plf_files[fileIdx];
+    fileEntry = plf_int_get_file(ctx, fileIdx);
 
     /* Open the given filename */
-    fileEntry->fildes = open(filename, O_RDONLY | F_O_BINARY);
+    fileEntry->fildes = open(filename, ((flags & PLF_OPEN_PATCH) ? O_RDWR : O_RDONLY) | F_O_BINARY);
 
     if (fileEntry->fildes < 0)
     {
-        plf_close(fileIdx);
+        plf_ctx_close(ctx, fileIdx);
         return PLF_E_IO;
     }
 
     fileEntry->flags |= PLF_FILE_FLAG_READ;
 
-    return plf_int_open_file(fileIdx);
+    if (flags & PLF_OPEN_LAZY)
+        fileEntry->flags |= PLF_FILE_FLAG_LAZY;
+
+    if (flags & PLF_OPEN_PATCH)
+        fileEntry->flags |= PLF_FILE_FLAG_PATCH;
+
+    if (flags & PLF_OPEN_INDEX)
+    {
+        struct stat file_stat;
+
+        /* Identify the file before it may be mapped and closed */
+        if (fstat(fileEntry->fildes, &file_stat) < 0)
+        {
+            plf_ctx_close(ctx, fileIdx);
+            return PLF_E_IO;
+        }
+
+        plf_int_get_idx_key(&file_stat, &fileEntry->idx_key);
+
+        if (ctx->idx_dir != 0)
+        {
+            /* Named after device and inode, the size and times are checked from the content */
+            fileEntry->idx_path = (char*) malloc(strlen(ctx->idx_dir) + 2 * 16 + 3 + sizeof(PLF_IDX_SUFFIX));
+            if (fileEntry->idx_path != 0)
+                sprintf(fileEntry->idx_path, "%s/%llx-%llx%s", ctx->idx_dir,
+                        (unsigned long long) fileEntry->idx_key.qwDevice,
+                        (unsigned long long) fileEntry->idx_key.qwInode, PLF_IDX_SUFFIX);
+        }
+        else
+        {
+            fileEntry->idx_path = (char*) malloc(strlen(filename) + sizeof(PLF_IDX_SUFFIX));
+            if (fileEntry->idx_path != 0)
+                sprintf(fileEntry->idx_path, "%s%s", filename, PLF_IDX_SUFFIX);
+        }
+
+        if (fileEntry->idx_path == 0)
+        {
+            plf_ctx_close(ctx, fileIdx);
+            return PLF_E_MEM;
+        }
+
+        fileEntry->flags |= PLF_FILE_FLAG_INDEX;
+    }
+
+    if (flags & PLF_OPEN_MMAP)
+    {
+        int retval = plf_int_map_file(ctx, fileIdx);
+        if (retval < 0)
+        {
+            plf_ctx_close(ctx, fileIdx);
+            return retval;
+        }
+    }
+
+    return plf_int_open_file(ctx, fileIdx);
 }
 
 /*
  * Open entry point to PLF file from memory
  */
-int plf_open_ram(const void* buffer, u32 buffer_size)
+int plf_ctx_open_ram(s_plf_ctx* ctx, const void* buffer, u32 buffer_size)
+{
+    return plf_ctx_open_ram_64(ctx, buffer, buffer_size);
+}
+
+int plf_ctx_open_ram_64(s_plf_ctx* ctx, const void* buffer, u64 buffer_size)
 {
     int fileIdx;
     s_plf_file_entry* fileEntry;
@@ -112,298 +330,565 @@ int plf_open_ram(const void* buffer, u32 buffer_size)
         return PLF_E_PARAM;
 
     /* Reserve a new file */
-    fileIdx = plf_int_new_file();
+    fileIdx = plf_int_new_file(ctx);
     if (fileIdx < 0)
         return fileIdx;
 
-    fileEntry = &plf_files[fileIdx];
+    fileEntry = plf_int_get_file(ctx, fileIdx);
     fileEntry->buffer = buffer;
     fileEntry->buffer_size = buffer_size;
 
     fileEntry->flags |= PLF_FILE_FLAG_READ;
 
-    return plf_int_open_file(fileIdx);
+    return plf_int_open_file(ctx, fileIdx);
+}
+
+/*
+ * Open a PLF file inside a section of another one
+ */
+int plf_ctx_open_section(s_plf_ctx* ctx, int parentIdx, int sectIdx)
+{
+    int fileIdx;
+    s_plf_file_entry* parentEntry;
+    s_plf_file_entry* fileEntry;
+    s_plf_section* section;
+    u64 offset;
+
+    PLF_GET_FILE_ENTRY(parentEntry, parentIdx);
+    section = plf_int_get_section(ctx, parentIdx, sectIdx);
+
+    if (section == 0)
+        return PLF_E_PARAM;
+
+    /* Compressed sections and files being written can't be read in place */
+    if (section->dwUncomprSize != 0 || (parentEntry->flags & PLF_FILE_FLAG_WRITE))
+        return PLF_E_PARAM;
+
+    offset = parentEntry->sect_offset[sectIdx];
+
+    /* Reserve a new file */
+    fileIdx = plf_int_new_file(ctx);
+    if (fileIdx < 0)
+        return fileIdx;
+
+    fileEntry = plf_int_get_file(ctx, fileIdx);
+
+    if (parentEntry->fildes == -1)
+    {
+        /* Parent in memory: the section is a RAM file */
+        if (offset > parentEntry->buffer_size
+                || section->dwSectionSize > parentEntry->buffer_size - offset)
+        {
+            plf_ctx_close(ctx, fileIdx);
+            return PLF_E_IO;
+        }
+
+        fileEntry->buffer = (const u8*) parentEntry->buffer + offset;
+        fileEntry->buffer_size = section->dwSectionSize;
+    }
+    else
+    {
+        /* Read through the file handle of the parent */
+        fileEntry->fildes = parentEntry->fildes;
+        fileEntry->window_offset = parentEntry->window_offset + offset;
+        fileEntry->window_size = section->dwSectionSize;
+    }
+
+    fileEntry->flags |= PLF_FILE_FLAG_READ | PLF_FILE_FLAG_WINDOW;
+    fileEntry->flags |= parentEntry->flags & PLF_FILE_FLAG_LAZY;
+
+    return plf_int_open_file(ctx, fileIdx);
 }
 
 
 /*
  * New PLF File
  */
-int plf_create_file(const char* filename)
+int plf_ctx_create_file(s_plf_ctx* ctx, const char* filename)
 {
     int fileIdx;
     s_plf_file_entry* fileEntry;
 
     /* Reserve a new file */
-    fileIdx = plf_int_new_file();
+    fileIdx = plf_int_new_file(ctx);
     if (fileIdx < 0)
         return fileIdx;
 
-    fileEntry = &plf_files[fileIdx];
+    fileEntry = plf_int_get_file(ctx, fileIdx);
 
     /* Open the given filename */
     fileEntry->fildes = open(filename,  O_RDWR | O_CREAT | F_O_BINARY, 0644  );
 
     if (fileEntry->fildes < 0)
     {
-        plf_close(fileIdx);
+        plf_ctx_close(ctx, fileIdx);
         return PLF_E_IO;
     }
 
-    fileEntry->hdr.dwHdrSize = sizeof(s_plf_file);
-    fileEntry->hdr.dwSectHdrSize = sizeof(s_plf_section);
-    fileEntry->hdr.dwHdrVersion = 0x0A;
+    fileEntry->wbuf_size = PLF_WRITE_BUFFER_SIZE;
+
+    return plf_int_create(ctx, fileIdx);
+}
+
+/*
+ * New PLF file in memory. Without a buffer libplf allocates one and grows
+ * it as needed (buffer_size is the initial size then), otherwise the file
+ * has to fit into the given buffer.
+ */
+int plf_ctx_create_ram(s_plf_ctx* ctx, void* buffer, u32 buffer_size)
+{
+    int fileIdx;
+    s_plf_file_entry* fileEntry;
+
+    if (buffer != 0 && buffer_size < sizeof(s_plf_file))
+        return PLF_E_NO_SPACE;
 
-    fileEntry->current_size =  plf_int_write(fileIdx, &(fileEntry->hdr), 0, sizeof(s_plf_file));
+    /* Reserve a new file */
+    fileIdx = plf_int_new_file(ctx);
+    if (fileIdx < 0)
+        return fileIdx;
 
+    fileEntry = plf_int_get_file(ctx, fileIdx);
 
+    if (buffer == 0)
+    {
+        if (buffer_size < PLF_MIN_RAM_SIZE)
+            buffer_size = PLF_MIN_RAM_SIZE;
 
-    fileEntry->flags |= PLF_FILE_FLAG_WRITE;
+        buffer = malloc(buffer_size);
+        if (buffer == 0)
+        {
+            plf_ctx_close(ctx, fileIdx);
+            return PLF_E_MEM;
+        }
 
-    return fileIdx;
+        fileEntry->flags |= PLF_FILE_FLAG_OWNBUF;
+    }
+
+    fileEntry->buffer = buffer;
+    fileEntry->buffer_size = buffer_size;
+
+    return plf_int_create(ctx, fileIdx);
+}
+
+/*
+ * Finish a file from plf_create_ram() and take its contents. The handle is
+ * closed. A buffer allocated by libplf belongs to the caller afterwards
+ * (release it with free()), otherwise *buffer is the caller's buffer.
+ */
+int plf_ctx_detach_ram(s_plf_ctx* ctx, int fileIdx, void** buffer, u64* buffer_size)
+{
+    s_plf_file_entry* fileEntry;
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    if (buffer == 0 || buffer_size == 0)
+        return PLF_E_PARAM;
+
+    if (fileEntry->fildes != -1 || (fileEntry->flags & PLF_FILE_FLAG_WRITE) == 0)
+        return PLF_E_PARAM;
+
+    if (fileEntry->flags & PLF_FILE_FLAG_SECTOPEN)
+        return PLF_E_OPENED;
+
+    /* Give back unused space */
+    if ((fileEntry->flags & PLF_FILE_FLAG_OWNBUF) && fileEntry->current_size < fileEntry->buffer_size)
+    {
+        void* new_buffer = realloc((void*) fileEntry->buffer, fileEntry->current_size);
+
+        if (new_buffer != 0)
+        {
+            fileEntry->buffer = new_buffer;
+            fileEntry->buffer_size = fileEntry->current_size;
+        }
+    }
+
+    *buffer = (void*) fileEntry->buffer;
+    *buffer_size = fileEntry->current_size;
+
+    /* Close renews the file header but keeps the buffer */
+    fileEntry->flags &= ~PLF_FILE_FLAG_OWNBUF;
+
+    return plf_ctx_close(ctx, fileIdx);
 }
 
 
 /*
  * Close the files, cleanup the memory
  */
-int plf_close(int fileIdx)
+int plf_ctx_close(s_plf_ctx* ctx, int fileIdx)
 {
     s_plf_file_entry* fileEntry;
-    PLF_VERIFY_IDX(fileIdx);
+    int retval = 0;
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
 
-    fileEntry = &plf_files[fileIdx];
+    /* Keep the index up to date, only complete section tables are written */
+    if ((fileEntry->flags & PLF_FILE_FLAG_IDXDIRTY)
+            && (fileEntry->flags & PLF_FILE_FLAG_OPENED))
+    {
+        plf_ctx_write_index(ctx, fileIdx);
+    }
 
     if (fileEntry->flags & PLF_FILE_FLAG_WRITE)
     {
         /* Renew file header */
-        fileEntry->hdr.dwFileSize = fileEntry->current_size;
-        plf_int_write(fileIdx, &(fileEntry->hdr), 0, sizeof(s_plf_file));
+        fileEntry->hdr.dwFileSize = (u32) fileEntry->current_size;
+        plf_int_write(ctx, fileIdx, &(fileEntry->hdr), 0, sizeof(s_plf_file));
     }
 
-    if (fileEntry->fildes >= 0)
+    /* Write what is left in the buffer */
+    if (fileEntry->wbuf_len > 0)
     {
-        close(fileEntry->fildes);
+        retval = plf_int_flush(ctx, fileIdx);
     }
 
-    fileEntry->hdr.dwMagic = 0;
-    fileEntry->fildes = -1;
-
-    if (fileEntry->entries != 0)
+    /* The file handle of a section file belongs to its parent */
+    if (fileEntry->fildes >= 0 && (fileEntry->flags & PLF_FILE_FLAG_WINDOW) == 0)
     {
-        s_plf_section_entry* nextEntry = 0;
-        s_plf_section_entry* curEntry = fileEntry->entries;
+        close(fileEntry->fildes);
+    }
 
-        while (curEntry)
-        {
-            nextEntry = curEntry->next;
-            free(curEntry);
-            curEntry = nextEntry;
-        }
+#ifndef __WIN32__
+    if (fileEntry->flags & PLF_FILE_FLAG_MMAP)
+    {
+        munmap((void*) fileEntry->buffer, fileEntry->buffer_size);
+    }
+#endif
 
-        fileEntry->entries = 0;
+    if (fileEntry->flags & PLF_FILE_FLAG_OWNBUF)
+    {
+        free((void*) fileEntry->buffer);
     }
 
+    fileEntry->hdr.dwMagic = 0;
+    fileEntry->flags = 0;
+    fileEntry->buffer = 0;
+    fileEntry->fildes = -1;
+
+    free(fileEntry->sect_hdr);
+    free(fileEntry->sect_offset);
+    free(fileEntry->sect_state);
+    free(fileEntry->idx_path);
+    free(fileEntry->wbuf);
+    gz_compress_end(fileEntry->gz_stream);
+
+    fileEntry->sect_hdr = 0;
+    fileEntry->sect_offset = 0;
+    fileEntry->sect_state = 0;
+    fileEntry->idx_path = 0;
+    fileEntry->wbuf = 0;
+    fileEntry->gz_stream = 0;
     fileEntry->num_entries = 0;
+    fileEntry->max_entries = 0;
 
-    return 0;
+    /* Back to the free list, invalidates all handles to this slot */
+    fileEntry->generation = (fileEntry->generation + 1) & PLF_HANDLE_GEN_MASK;
+    fileEntry->next_free = ctx->pool.free_slot;
+    ctx->pool.free_slot = PLF_HANDLE_SLOT(fileIdx);
+
+    return retval;
 }
 
 /*
  * Get PLF header
  */
-s_plf_file* plf_get_file_header(int fileIdx)
+s_plf_file* plf_ctx_get_file_header(s_plf_ctx* ctx, int fileIdx)
 {
-    if (fileIdx >= PLF_MAX_ALLOWED_FILES || plf_files[fileIdx].hdr.dwMagic
-            != PLF_MAGIC_CODE)
-    {
+    s_plf_file_entry* fileEntry = plf_int_get_file(ctx, fileIdx);
+
+    if (fileEntry == 0)
         return 0;
-    }
 
-    return &(plf_files[fileIdx].hdr);
+    return &(fileEntry->hdr);
 }
 
 
 /*
  * Number of section in the file
  */
-int plf_get_num_sections(int fileIdx)
+int plf_ctx_get_num_sections(s_plf_ctx* ctx, int fileIdx)
 {
-    PLF_VERIFY_IDX(fileIdx);
-    return plf_files[fileIdx].num_entries;
+    s_plf_file_entry* fileEntry;
+    int retval;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    /* All sections have to be known */
+    retval = plf_int_read_entries(ctx, fileIdx, PLF_SCAN_ALL);
+    if (retval < 0)
+        return retval;
+
+    return fileEntry->num_entries;
 }
 
 /*
  * Get Section header
  */
-s_plf_section* plf_get_section_header(int fileIdx, int sectIdx)
+s_plf_section* plf_ctx_get_section_header(s_plf_ctx* ctx, int fileIdx, int sectIdx)
 {
-    s_plf_section_entry* curEntry;
-    curEntry = plf_int_get_section(fileIdx, sectIdx);
-
-    if (!curEntry)
-        return 0;
-
-    return &(curEntry->hdr);
+    return plf_int_get_section(ctx, fileIdx, sectIdx);
 }
 
 
 /*
  * Content of a section
  */
-int plf_get_payload_raw(int fileIdx, int sectIdx, void* dst_buffer, u32 offset,
+int plf_ctx_get_payload_raw(s_plf_ctx* ctx, int fileIdx, int sectIdx, void* dst_buffer, u32 offset,
         u32 len)
 {
-    s_plf_section_entry* curEntry;
+    return (int) plf_ctx_get_payload_raw_64(ctx, fileIdx, sectIdx, dst_buffer, offset, len);
+}
+
+s64 plf_ctx_get_payload_raw_64(s_plf_ctx* ctx, int fileIdx, int sectIdx, void* dst_buffer, u64 offset,
+        u64 len)
+{
+    s_plf_file_entry* fileEntry;
+    s_plf_section* curSection;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+    curSection = plf_int_get_section(ctx, fileIdx, sectIdx);
+
+    if (!curSection || offset > curSection->dwSectionSize)
+        return PLF_E_PARAM;
+
+    //printf("plf_get_payload_raw [%d,%d]: offset: 0x%08llx len: 0x%08x\n", fileIdx, sectIdx, fileEntry->sect_offset[sectIdx], curSection->dwSectionSize);
+    if (curSection->dwSectionSize - offset < len)
+        len = curSection->dwSectionSize - offset;
 
-    PLF_VERIFY_IDX(fileIdx);
-    curEntry = plf_int_get_section(fileIdx, sectIdx);
+    return plf_int_read(ctx, fileIdx, dst_buffer, fileEntry->sect_offset[sectIdx] + offset, len);
+}
+
+/*
+ * Position of the section content in the file
+ */
+s64 plf_ctx_get_section_offset_64(s_plf_ctx* ctx, int fileIdx, int sectIdx)
+{
+    s_plf_file_entry* fileEntry;
 
-    if (!curEntry)
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    if (plf_int_get_section(ctx, fileIdx, sectIdx) == 0)
         return PLF_E_PARAM;
 
-    //printf("plf_get_payload_raw [%d,%d]: offset: 0x%08x len: 0x%08x\n", fileIdx, sectIdx, curEntry->offset, curEntry->hdr.dwSectionSize);
-    if (curEntry->hdr.dwSectionSize - offset < len)
-        len = curEntry->hdr.dwSectionSize - offset;
+    return fileEntry->sect_offset[sectIdx];
+}
+
+/*
+ * Size of the file (or buffer) on the disk
+ */
+s64 plf_ctx_get_file_size_64(s_plf_ctx* ctx, int fileIdx)
+{
+    s_plf_file_entry* fileEntry;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    if (fileEntry->flags & PLF_FILE_FLAG_WRITE)
+        return fileEntry->current_size;
 
-    return plf_int_read(fileIdx, dst_buffer, curEntry->offset + offset, len);
+    return fileEntry->scan_end;
 }
 
 
 /*
  * Content of a section, conpressed
  */
-int plf_get_payload_uncompressed(int fileIdx, int sectIdx, void** buffer, u32* buffer_size)
+int plf_ctx_get_payload_uncompressed(s_plf_ctx* ctx, int fileIdx, int sectIdx, void** buffer, u32* buffer_size)
 {
-    s_plf_section_entry* curEntry;
+    s_plf_file_entry* fileEntry;
+    s_plf_section* curSection;
     void* tmpBuffer;
 
-    PLF_VERIFY_IDX(fileIdx);
-    curEntry = plf_int_get_section(fileIdx, sectIdx);
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+    curSection = plf_int_get_section(ctx, fileIdx, sectIdx);
 
-    if (!curEntry || buffer == 0 || buffer_size == 0)
+    if (!curSection || buffer == 0 || buffer_size == 0)
         return PLF_E_PARAM;
 
-    /* Allocate a temp buffer */
-    tmpBuffer = malloc(curEntry->hdr.dwSectionSize);
-
-    if (tmpBuffer == 0)
-        return PLF_E_MEM;
-
     *buffer_size = 0;
     *buffer = 0;
 
-    /* Read raw data */
-    plf_get_payload_raw(fileIdx, sectIdx, tmpBuffer, 0, curEntry->hdr.dwSectionSize);
-
-    if (curEntry->hdr.dwUncomprSize == 0)
+    if (curSection->dwUncomprSize == 0)
     {
-        *buffer = tmpBuffer;
-        *buffer_size = curEntry->hdr.dwSectionSize;
+        /* Allocate a buffer for the caller */
+        tmpBuffer = malloc(curSection->dwSectionSize);
+
+        if (tmpBuffer == 0)
+            return PLF_E_MEM;
+
+        /* Read raw data */
+        plf_ctx_get_payload_raw(ctx, fileIdx, sectIdx, tmpBuffer, 0, curSection->dwSectionSize);
+
+        *buffer = tmpBuffer;
+        *buffer_size = curSection->dwSectionSize;
     }
     else
     {
+        const void* comprBuffer;
+        u32 comprSize;
         void* uncomprBuffer;
         int gz_ret;
 
+        /* Compressed data is only needed temporarily: decompress it in place if possible */
+        gz_ret = plf_ctx_get_payload_view(ctx, fileIdx, sectIdx, &comprBuffer, &comprSize);
+        if (gz_ret < 0)
+            return gz_ret;
+
         /* Allocate the uncompressed buffer */
-        uncomprBuffer = malloc(curEntry->hdr.dwUncomprSize);
+        uncomprBuffer = malloc(curSection->dwUncomprSize);
         if (uncomprBuffer == 0)
         {
-            free(tmpBuffer);
+            plf_ctx_release_payload_view(ctx, fileIdx, comprBuffer);
             return PLF_E_MEM;
         }
 
-        *buffer_size = curEntry->hdr.dwUncomprSize;
+        *buffer_size = curSection->dwUncomprSize;
 
         /* Decompress */
-        gz_ret = gz_uncompress(uncomprBuffer, buffer_size, tmpBuffer, curEntry->hdr.dwSectionSize);
+        gz_ret = gz_uncompress(uncomprBuffer, buffer_size, comprBuffer, comprSize);
+        plf_ctx_release_payload_view(ctx, fileIdx, comprBuffer);
+
         if (gz_ret < 0)
         {
             *buffer_size = 0;
             free(uncomprBuffer);
-            free(tmpBuffer);
             return PLF_E_STREAM;
         }
 
-        free(tmpBuffer);
         *buffer = uncomprBuffer;
     }
 
     return 0;
 }
 
+
 /*
- * CRC32 checksum of a section
+ * Content of a section without copy. For RAM and mapped files the returned
+ * pointer refers directly to the file contents, otherwise the section is read
+ * into a temporary buffer. Either way the view has to be given back with
+ * plf_release_payload_view() before the file is closed.
  */
-int plf_check_crc(int fileIdx, int sectIdx)
+int plf_ctx_get_payload_view(s_plf_ctx* ctx, int fileIdx, int sectIdx, const void** payload, u32* len)
 {
-    u32 crc_accum = 0;
-    u32 crc_num_size = 0;
-    s_plf_section_entry* section;
     s_plf_file_entry* fileEntry;
+    s_plf_section* curSection;
+    u64 offset;
+    void* tmpBuffer;
+    s64 bytes_read;
 
-    PLF_VERIFY_IDX(fileIdx);
-
-    section = plf_int_get_section(fileIdx, sectIdx);
-    fileEntry = &plf_files[fileIdx];
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+    curSection = plf_int_get_section(ctx, fileIdx, sectIdx);
 
-    if (section == 0)
+    if (!curSection || payload == 0 || len == 0)
         return PLF_E_PARAM;
 
+    *payload = 0;
+    *len = 0;
+
+    offset = fileEntry->sect_offset[sectIdx];
+
     if (fileEntry->fildes == -1)
     {
-        // Buffer case
+        /* Already in memory */
+        if (offset > fileEntry->buffer_size
+                || curSection->dwSectionSize > fileEntry->buffer_size - offset)
+            return PLF_E_IO;
 
-        crc32_calc_buffer(&crc_accum, &crc_num_size, (((u8*) fileEntry->buffer)
-                + section->offset), section->hdr.dwSectionSize);
-        crc32_calc_dw(&crc_accum, &crc_num_size);
+        *payload = (const u8*) fileEntry->buffer + offset;
+        *len = curSection->dwSectionSize;
+        return 0;
     }
-    else
+
+    /* Read from the file; at least one byte so the view is never null */
+    tmpBuffer = malloc(curSection->dwSectionSize ? curSection->dwSectionSize : 1);
+
+    if (tmpBuffer == 0)
+        return PLF_E_MEM;
+
+    bytes_read = plf_int_read(ctx, fileIdx, tmpBuffer, offset, curSection->dwSectionSize);
+    if (bytes_read != curSection->dwSectionSize)
     {
-        // File case.. we need to read the contents of the file
-        u8* tmpBuf = (u8*) malloc(0x1000);
+        free(tmpBuffer);
+        return (bytes_read < 0) ? (int) bytes_read : PLF_E_IO;
+    }
 
-        if (tmpBuf == 0)
-            return PLF_E_MEM;
+    *payload = tmpBuffer;
+    *len = curSection->dwSectionSize;
+    return 0;
+}
 
-        u32 bytes_remaining = section->hdr.dwSectionSize;
+/*
+ * Give back a view from plf_get_payload_view()
+ */
+int plf_ctx_release_payload_view(s_plf_ctx* ctx, int fileIdx, const void* payload)
+{
+    s_plf_file_entry* fileEntry;
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
 
-        while (bytes_remaining > 0)
-        {
-            u32 read_len;
-            if (bytes_remaining > 0x1000)
-            {
-                read_len = 0x1000;
-            }
-            else
-            {
-                read_len = bytes_remaining;
-            }
+    if (payload == 0)
+        return PLF_E_PARAM;
 
-            u32 offset = section->hdr.dwSectionSize - bytes_remaining;
+    /* Pointers into the file buffer are not owned by the view */
+    if (fileEntry->fildes == -1)
+        return 0;
 
-            u32 bytes_read = plf_get_payload_raw(fileIdx, sectIdx, tmpBuf,
-                    offset, read_len);
-            if (bytes_read < 0)
-            {
-                free(tmpBuf);
-                return bytes_read;
-            }
+    free((void*) payload);
+    return 0;
+}
 
-            crc32_calc_buffer(&crc_accum, &crc_num_size, tmpBuf, read_len);
+/*
+ * Remember the result of a CRC check (for plf_copy_section and the index),
+ * unless the section may still change
+ */
+static void plf_int_set_crc_state(s_plf_file_entry* fileEntry, int sectIdx, int crc_ok)
+{
+    if (fileEntry->flags & PLF_FILE_FLAG_WRITE)
+        return;
 
-            bytes_remaining -= read_len;
+    fileEntry->sect_state[sectIdx] = crc_ok ? PLF_SECT_CRC_OK : PLF_SECT_CRC_BAD;
 
-        }
+    /* Atomic, plf_verify_parallel() checks several sections at once */
+    if ((fileEntry->flags & (PLF_FILE_FLAG_INDEX | PLF_FILE_FLAG_IDXDIRTY)) == PLF_FILE_FLAG_INDEX)
+        __sync_fetch_and_or(&fileEntry->flags, PLF_FILE_FLAG_IDXDIRTY);
+}
 
-        // finish crc
-        free(tmpBuf);
-        crc32_calc_dw(&crc_accum, &crc_num_size);
+/*
+ * CRC32 checksum of a section
+ */
+int plf_ctx_check_crc(s_plf_ctx* ctx, int fileIdx, int sectIdx)
+{
+    return plf_int_check_crc(ctx, fileIdx, sectIdx, 1);
+}
 
-    }
+/*
+ * plf_ctx_check_crc(), split: large sections may be checksummed on several threads
+ */
+static int plf_int_check_crc(s_plf_ctx* ctx, int fileIdx, int sectIdx, int split)
+{
+    u32 crc_accum = 0;
+    s_plf_section* section;
+    s_plf_file_entry* fileEntry;
+    int retval;
 
-    if (crc_accum == section->hdr.dwCRC32)
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    section = plf_int_get_section(ctx, fileIdx, sectIdx);
+
+    if (section == 0)
+        return PLF_E_PARAM;
+
+    /* Already checked, in this session or when the index was written */
+    if (fileEntry->sect_state[sectIdx] == PLF_SECT_CRC_OK)
+        return 0;
+
+    if (fileEntry->sect_state[sectIdx] == PLF_SECT_CRC_BAD)
+        return PLF_E_CRC;
+
+    retval = plf_int_calc_crc(ctx, fileIdx, sectIdx, split, &crc_accum);
+    if (retval < 0)
+        return retval;
+
+    plf_int_set_crc_state(fileEntry, sectIdx, crc_accum == section->dwCRC32);
+
+    if (crc_accum == section->dwCRC32)
         return 0;
     else
         return PLF_E_CRC;
@@ -413,20 +898,18 @@ int plf_check_crc(int fileIdx, int sectIdx)
 /*
  * Verify CRC32 of all sections
  */
-int plf_verify(int fileIdx)
+int plf_ctx_verify(s_plf_ctx* ctx, int fileIdx)
 {
     int i, num_entries;
 
-    PLF_VERIFY_IDX(fileIdx);
-
-    num_entries = plf_get_num_sections(fileIdx);
+    num_entries = plf_ctx_get_num_sections(ctx, fileIdx);
 
     if (num_entries <= 0)
         return num_entries;
 
     for (i = 0; i < num_entries; ++i)
     {
-        if (plf_check_crc(fileIdx, i) != 0)
+        if (plf_ctx_check_crc(ctx, fileIdx, i) != 0)
             return PLF_E_CRC;
     }
 
@@ -434,17 +917,258 @@ int plf_verify(int fileIdx)
     return 0;
 }
 
+/* Section of plf_ctx_verify_parallel() */
+typedef struct
+{
+    u32         size;
+    int         sectIdx;
+} s_plf_verify_item;
+
+/* Work shared by the threads of plf_ctx_verify_parallel() */
+typedef struct
+{
+    s_plf_ctx*          ctx;
+    int                 fileIdx;
+    s_plf_verify_item*  items;            // Largest section first
+    int                 num_items;
+    int                 next_item;        // Next item to check, taken atomically
+    int                 split_crc;        // Sections may be split, only with a single verify thread
+    int*                results;
+} s_plf_verify_job;
+
+static int plf_int_cmp_verify_item(const void* a, const void* b)
+{
+    const s_plf_verify_item* item_a = (const s_plf_verify_item*) a;
+    const s_plf_verify_item* item_b = (const s_plf_verify_item*) b;
+
+    if (item_a->size != item_b->size)
+        return (item_a->size > item_b->size) ? -1 : 1;
+
+    return item_a->sectIdx - item_b->sectIdx;
+}
+
+static void* plf_int_verify_thread(void* arg)
+{
+    s_plf_verify_job* job = (s_plf_verify_job*) arg;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&job->next_item, 1)) < job->num_items)
+    {
+        int sectIdx = job->items[i].sectIdx;
+        job->results[sectIdx] = plf_int_check_crc(job->ctx, job->fileIdx, sectIdx, job->split_crc);
+    }
+
+    return 0;
+}
+
+/*
+ * Verify CRC32 of all sections on nthreads threads. The sections are handed
+ * out largest first, so a big section doesn't end up last on one thread.
+ */
+int plf_ctx_verify_parallel(s_plf_ctx* ctx, int fileIdx, int nthreads, int* results)
+{
+    s_plf_file_entry* fileEntry;
+    s_plf_verify_job job;
+    int* own_results = 0;
+    int i, num_entries, retval;
+
+    /* Reads all section headers, the threads only read payloads */
+    num_entries = plf_ctx_get_num_sections(ctx, fileIdx);
+
+    if (num_entries <= 0)
+        return num_entries;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    if (results == 0)
+    {
+        own_results = (int*) malloc(num_entries * sizeof(int));
+        if (own_results == 0)
+            return PLF_E_MEM;
+
+        results = own_results;
+    }
+
+    job.ctx = ctx;
+    job.fileIdx = fileIdx;
+    job.num_items = num_entries;
+    job.next_item = 0;
+    job.split_crc = 1;
+    job.results = results;
+    job.items = (s_plf_verify_item*) malloc(num_entries * sizeof(s_plf_verify_item));
+
+    if (job.items == 0)
+    {
+        free(own_results);
+        return PLF_E_MEM;
+    }
+
+    for (i = 0; i < num_entries; ++i)
+    {
+        job.items[i].size = fileEntry->sect_hdr[i].dwSectionSize;
+        job.items[i].sectIdx = i;
+    }
+
+    qsort(job.items, num_entries, sizeof(s_plf_verify_item), plf_int_cmp_verify_item);
+
+#ifndef __WIN32__
+    if (nthreads <= 0)
+        nthreads = plf_int_num_cpus();
+
+    if (nthreads > num_entries)
+        nthreads = num_entries;
+
+    /* Files being written flush their write buffer on reads, keep them on one thread */
+    if (fileEntry->flags & PLF_FILE_FLAG_WRITE)
+        nthreads = 1;
+
+    if (nthreads > 1)
+    {
+        pthread_t* threads = (pthread_t*) malloc((nthreads - 1) * sizeof(pthread_t));
+        int num_started = 0;
+
+        /* The verify threads already use the CPUs, no threads of their own */
+        job.split_crc = 0;
+
+        if (threads != 0)
+        {
+            while (num_started < nthreads - 1
+                    && pthread_create(&threads[num_started], 0, plf_int_verify_thread, &job) == 0)
+                ++num_started;
+        }
+
+        if (num_started == 0)
+            job.split_crc = 1;
+
+        plf_int_verify_thread(&job);
+
+        for (i = 0; i < num_started; ++i)
+            pthread_join(threads[i], 0);
+
+        free(threads);
+    }
+    else
+#endif
+    {
+        /* Pread is emulated on Windows, not thread-safe */
+        plf_int_verify_thread(&job);
+    }
+
+    free(job.items);
+
+    retval = 0;
+    for (i = 0; i < num_entries && retval == 0; ++i)
+        retval = results[i];
+
+    free(own_results);
+    return retval;
+}
+
+/*
+ * Write the sidecar index of the file (See PLF_OPEN_INDEX). The index is
+ * written to a temporary file first, so readers never see a partial one.
+ */
+int plf_ctx_write_index(s_plf_ctx* ctx, int fileIdx)
+{
+    s_plf_file_entry* fileEntry;
+    s_plf_idx_header* idxHeader;
+    s_plf_idx_entry* idxEntry;
+    char* tmp_path;
+    u8* idx_buf;
+    u64 idx_size;
+    u32 i;
+    int fd, retval;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    if ((fileEntry->flags & PLF_FILE_FLAG_INDEX) == 0)
+        return PLF_E_PARAM;
+
+    /* The index holds all sections */
+    retval = plf_int_read_entries(ctx, fileIdx, PLF_SCAN_ALL);
+    if (retval < 0)
+        return retval;
+
+    idx_size = sizeof(s_plf_idx_header) + (u64) fileEntry->num_entries * sizeof(s_plf_idx_entry);
+    if ((size_t) idx_size != idx_size)
+        return PLF_E_MEM;
+
+    idx_buf = (u8*) malloc(idx_size);
+    if (idx_buf == 0)
+        return PLF_E_MEM;
+
+    idxHeader = (s_plf_idx_header*) idx_buf;
+    memset(idxHeader, 0, sizeof(s_plf_idx_header));
+    idxHeader->dwMagic = PLF_IDX_MAGIC;
+    idxHeader->dwVersion = PLF_IDX_VERSION;
+    idxHeader->dwHdrSize = sizeof(s_plf_idx_header);
+    idxHeader->dwEntrySize = sizeof(s_plf_idx_entry);
+    idxHeader->key = fileEntry->idx_key;
+    idxHeader->dwNumEntries = fileEntry->num_entries;
+    idxHeader->dwHashType = PLF_IDX_HASH_NONE;
+    idxHeader->qwScanEnd = fileEntry->scan_offset;
+    idxHeader->hdr = fileEntry->hdr;
+
+    idxEntry = (s_plf_idx_entry*) (idx_buf + sizeof(s_plf_idx_header));
+    for (i = 0; i < fileEntry->num_entries; ++i)
+    {
+        idxEntry[i].sect = fileEntry->sect_hdr[i];
+        idxEntry[i].dwCrcState = fileEntry->sect_state[i];
+        idxEntry[i].qwOffset = fileEntry->sect_offset[i];
+    }
+
+    tmp_path = (char*) malloc(strlen(fileEntry->idx_path) + 32);
+    if (tmp_path == 0)
+    {
+        free(idx_buf);
+        return PLF_E_MEM;
+    }
+
+    /* Unique per call: other handles or contexts may write the same index */
+    sprintf(tmp_path, "%s.%d.%u", fileEntry->idx_path, (int) getpid(),
+            __sync_fetch_and_add(&plf_idx_tmp_counter, 1u));
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | F_O_BINARY, 0644);
+    if (fd < 0)
+    {
+        free(tmp_path);
+        free(idx_buf);
+        return PLF_E_IO;
+    }
+
+    retval = (plf_pwrite(fd, idx_buf, idx_size, 0) == (s64) idx_size) ? 0 : PLF_E_IO;
+    close(fd);
+
+    if (retval == 0)
+    {
+#ifdef __WIN32__
+        /* rename() does not replace existing files */
+        unlink(fileEntry->idx_path);
+#endif
+        if (rename(tmp_path, fileEntry->idx_path) < 0)
+            retval = PLF_E_IO;
+    }
+
+    if (retval < 0)
+        unlink(tmp_path);
+    else
+        fileEntry->flags &= ~PLF_FILE_FLAG_IDXDIRTY;
+
+    free(tmp_path);
+    free(idx_buf);
+
+    return retval;
+}
+
 /*
  * Initialize new section
  */
-int plf_begin_section(int fileIdx)
+int plf_ctx_begin_section(s_plf_ctx* ctx, int fileIdx)
 {
     int newSctIdx;
     s_plf_file_entry* fileEntry;
 
-    PLF_VERIFY_IDX(fileIdx);
-
-    fileEntry = &plf_files[fileIdx];
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
 
     /* Check if this filentry is writable */
     if ( (fileEntry->flags & PLF_FILE_FLAG_WRITE) == 0)
@@ -465,11 +1189,11 @@ int plf_begin_section(int fileIdx)
     newSection->dwSectionType=0;
     newSection->dwUncomprSize=0;
 
-    newSctIdx = plf_int_add_entry(fileIdx, newSection, fileEntry->current_size + sizeof(s_plf_section));
+    newSctIdx = plf_int_add_entry(ctx, fileIdx, newSection, fileEntry->current_size + sizeof(s_plf_section));
 
     if (newSctIdx >= 0)
     {
-        if (plf_int_write(fileIdx, newSection, fileEntry->current_size, sizeof(s_plf_section)) == sizeof(s_plf_section))
+        if (plf_int_write(ctx, fileIdx, newSection, fileEntry->current_size, sizeof(s_plf_section)) == sizeof(s_plf_section))
         {
             fileEntry->flags |= PLF_FILE_FLAG_SECTOPEN;
             fileEntry->current_size += sizeof(s_plf_section);
@@ -481,17 +1205,74 @@ int plf_begin_section(int fileIdx)
 }
 
 /*
- * Add payload to a section
+ * Destination of the compressed data of a section (See plf_int_gz_out)
  */
-int plf_write_payload(int fileIdx, int sectIndx, const void* buffer, u32 len, u8 compress)
+typedef struct s_plf_gz_out_tag
+{
+    s_plf_ctx*              ctx;
+    int                     fileIdx;
+    s_plf_section*          sectEntry;
+    int                     error;        // First write error
+} s_plf_gz_out;
+
+/*
+ * Append compressed data to the open section
+ */
+static int plf_int_gz_out(void* arg, const u8* data, u32 len)
+{
+    s_plf_gz_out* gz_out = (s_plf_gz_out*) arg;
+    s_plf_file_entry* fileEntry = plf_int_get_file(gz_out->ctx, gz_out->fileIdx);
+    u32 num_crc = 0;
+    int bytes_written;
+
+    bytes_written = plf_int_write(gz_out->ctx, gz_out->fileIdx, data, fileEntry->current_size, len);
+
+    if (bytes_written != (int) len)
+    {
+        gz_out->error = (bytes_written < 0) ? bytes_written : PLF_E_IO;
+        return gz_out->error;
+    }
+
+    fileEntry->current_size += len;
+    gz_out->sectEntry->dwSectionSize += len;
+    crc32_calc_buffer(&gz_out->sectEntry->dwCRC32, &num_crc, data, len);
+
+    return 0;
+}
+
+/*
+ * Feed the compressor of the open section, finish ends the gzip stream
+ */
+static int plf_int_compress(s_plf_ctx* ctx, int fileIdx, s_plf_section* sectEntry, const void* buffer, u32 len,
+        int finish)
+{
+    s_plf_file_entry* fileEntry = plf_int_get_file(ctx, fileIdx);
+    s_plf_gz_out gz_out;
+
+    gz_out.ctx = ctx;
+    gz_out.fileIdx = fileIdx;
+    gz_out.sectEntry = sectEntry;
+    gz_out.error = 0;
+
+    if (gz_compress(fileEntry->gz_stream, buffer, len, finish, plf_int_gz_out, &gz_out) < 0)
+        return (gz_out.error < 0) ? gz_out.error : PLF_E_STREAM;
+
+    return 0;
+}
+
+/*
+ * Add payload to a section. compress is the gzip level (1-9, higher values
+ * use the default level), the data is compressed as it is written.
+ */
+int plf_ctx_write_payload(s_plf_ctx* ctx, int fileIdx, int sectIndx, const void* buffer, u32 len, u8 compress)
 {
     u32 bytes_written;
+    int retval;
+    int nthreads = 1;
     s_plf_file_entry* fileEntry;
-    s_plf_section_entry* sectEntry;
-
-    PLF_VERIFY_IDX(fileIdx);
+    s_plf_section* sectEntry;
 
-    fileEntry = &plf_files[fileIdx];
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
 
     if (sectIndx > fileEntry->num_entries || buffer == 0)
         return PLF_E_PARAM;
@@ -504,20 +1285,44 @@ int plf_write_payload(int fileIdx, int sectIndx, const void* buffer, u32 len, u8
     if ( (fileEntry->flags & PLF_FILE_FLAG_SECTOPEN) == 0)
         return PLF_E_NOT_OPENED;
 
+    sectEntry = plf_int_get_section(ctx, fileIdx, sectIndx);
+
+    /* A section is either compressed or not */
+    if (fileEntry->gz_stream != 0 ? (compress == 0) : (compress != 0 && sectEntry->dwSectionSize != 0))
+        return PLF_E_PARAM;
+
     if (compress != 0)
-        return PLF_E_NOT_IMPLEMENTED;
+    {
+        if (fileEntry->gz_stream == 0)
+        {
+#ifndef __WIN32__
+            /* Large sections are compressed in blocks on several threads */
+            nthreads = plf_int_num_cpus();
+            if (nthreads > PLF_GZ_MAX_THREADS)
+                nthreads = PLF_GZ_MAX_THREADS;
+#endif
+            fileEntry->gz_stream = gz_compress_begin((compress <= 9) ? compress : -1, nthreads);
+            if (fileEntry->gz_stream == 0)
+                return PLF_E_MEM;
+        }
+
+        retval = plf_int_compress(ctx, fileIdx, sectEntry, buffer, len, 0);
+        if (retval < 0)
+            return retval;
 
-    sectEntry = plf_int_get_section(fileIdx, sectIndx);
+        sectEntry->dwUncomprSize += len;
+        return len;
+    }
 
-    bytes_written =  plf_int_write(fileIdx, buffer, fileEntry->current_size, len);
+    bytes_written =  plf_int_write(ctx, fileIdx, buffer, fileEntry->current_size, len);
 
     if (bytes_written > 0)
     {
         u32 num_crc=0;
         fileEntry->current_size += bytes_written;
-        sectEntry->hdr.dwSectionSize += bytes_written;
+        sectEntry->dwSectionSize += bytes_written;
 
-        crc32_calc_buffer(&sectEntry->hdr.dwCRC32, &num_crc, buffer, bytes_written);
+        crc32_calc_buffer(&sectEntry->dwCRC32, &num_crc, buffer, bytes_written);
     }
 
     return bytes_written;
@@ -526,15 +1331,13 @@ int plf_write_payload(int fileIdx, int sectIndx, const void* buffer, u32 len, u8
 /*
  * Finalize section, compute CRC 32, add to file
  */
-int plf_finish_section(int fileIdx, int sectIdx)
+int plf_ctx_finish_section(s_plf_ctx* ctx, int fileIdx, int sectIdx)
 {
     s_plf_file_entry* fileEntry;
-    s_plf_section_entry* sectEntry;
+    s_plf_section* sectEntry;
     int bytes_written;
 
-    PLF_VERIFY_IDX(fileIdx);
-
-    fileEntry = &plf_files[fileIdx];
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
 
     if (sectIdx > fileEntry->num_entries)
         return PLF_E_PARAM;
@@ -547,24 +1350,35 @@ int plf_finish_section(int fileIdx, int sectIdx)
     if ( (fileEntry->flags & PLF_FILE_FLAG_SECTOPEN) == 0)
         return PLF_E_NOT_OPENED;
 
-    sectEntry = plf_int_get_section(fileIdx, sectIdx);
+    sectEntry = plf_int_get_section(ctx, fileIdx, sectIdx);
+
+    /* Rest of the compressed data, the CRC covers the gzip stream */
+    if (fileEntry->gz_stream != 0)
+    {
+        bytes_written = plf_int_compress(ctx, fileIdx, sectEntry, 0, 0, 1);
+
+        gz_compress_end(fileEntry->gz_stream);
+        fileEntry->gz_stream = 0;
 
+        if (bytes_written < 0)
+            return bytes_written;
+    }
 
-    crc32_calc_dw(&sectEntry->hdr.dwCRC32, &sectEntry->hdr.dwSectionSize);
+    crc32_calc_dw(&sectEntry->dwCRC32, &sectEntry->dwSectionSize);
 
     /* Renew header */
-    bytes_written =  plf_int_write(fileIdx, &(sectEntry->hdr), sectEntry->offset-sizeof(s_plf_section), sizeof(s_plf_section));
+    bytes_written =  plf_int_write(ctx, fileIdx, sectEntry, fileEntry->sect_offset[sectIdx]-sizeof(s_plf_section), sizeof(s_plf_section));
 
     if (bytes_written != sizeof(s_plf_section) )
         return bytes_written;
 
 
     /* Align */
-    int bytes_to_skip = 4 - (sectEntry->hdr.dwSectionSize & 3);
+    int bytes_to_skip = 4 - (sectEntry->dwSectionSize & 3);
     if (bytes_to_skip != 4)
     {
         u32 data = 0;
-        plf_int_write(fileIdx, &data, fileEntry->current_size, bytes_to_skip );
+        plf_int_write(ctx, fileIdx, &data, fileEntry->current_size, bytes_to_skip );
 
         fileEntry->current_size += bytes_to_skip;
 
@@ -576,254 +1390,1580 @@ int plf_finish_section(int fileIdx, int sectIdx)
 }
 
 /*
- * Create a new file.
+ * Add a complete section: header, payload and padding at once
  */
-static int plf_int_new_file()
+int plf_ctx_write_section(s_plf_ctx* ctx, int fileIdx, const s_plf_section* hdr, const struct iovec* iov, int iovcnt)
+{
+    return plf_ctx_write_section_ex(ctx, fileIdx, hdr, iov, iovcnt, 0);
+}
+
+/*
+ * Add a complete section, flags see PLF_WRITE_xxx
+ */
+int plf_ctx_write_section_ex(s_plf_ctx* ctx, int fileIdx, const s_plf_section* hdr, const struct iovec* iov, int iovcnt,
+        u32 flags)
 {
-    int fileIdx;
     s_plf_file_entry* fileEntry;
+    s_plf_section newSection;
+    struct iovec* out_iov;
+    u64 payload_len = 0;
+    u64 sect_offset, sect_len;
+    u32 num_crc = 0;
+    u32 padding = 0;
+    u32 bytes_to_skip;
+    int i, out_cnt, newSctIdx, retval = 0;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    if (hdr == 0 || iovcnt < 0 || (iovcnt > 0 && iov == 0))
+        return PLF_E_PARAM;
 
-    /* Look for a free index in the plf_file array */
-    for (fileIdx = 0; fileIdx < PLF_MAX_ALLOWED_FILES; ++fileIdx)
-    {
-        if (plf_files[fileIdx].hdr.dwMagic != PLF_MAGIC_CODE)
-            break;
-    }
+    /* Check if this filentry is writable */
+    if ( (fileEntry->flags & PLF_FILE_FLAG_WRITE) == 0)
+        return PLF_E_WRITE;
+
+    /* Check if section previous section is closed */
+    if ( (fileEntry->flags & PLF_FILE_FLAG_SECTOPEN) != 0)
+        return PLF_E_OPENED;
+
+    for (i = 0; i < iovcnt; ++i)
+        payload_len += iov[i].iov_len;
+
+    /* The section size is 32 bit */
+    if (payload_len > 0xFFFFFFFFu)
+        return PLF_E_PARAM;
+
+    newSection.dwSectionType = hdr->dwSectionType;
+    newSection.dwLoadAddr = hdr->dwLoadAddr;
+    newSection.dwUncomprSize = hdr->dwUncomprSize;
+    newSection.dwSectionSize = (u32) payload_len;
+    newSection.dwCRC32 = 0;
+
+    if ((flags & PLF_WRITE_KEEP_CRC) && (flags & PLF_WRITE_VERIFY_CRC) == 0)
+    {
+        /* Known by the caller */
+        newSection.dwCRC32 = hdr->dwCRC32;
+    }
+    else
+    {
+        for (i = 0; i < iovcnt; ++i)
+            crc32_calc_buffer(&newSection.dwCRC32, &num_crc, (const u8*) iov[i].iov_base, iov[i].iov_len);
+
+        crc32_calc_dw(&newSection.dwCRC32, &newSection.dwSectionSize);
+
+        /* Nothing is written for a damaged copy */
+        if ((flags & PLF_WRITE_VERIFY_CRC) && newSection.dwCRC32 != hdr->dwCRC32)
+            return PLF_E_CRC;
+    }
+
+    /* Align */
+    bytes_to_skip = (4 - (newSection.dwSectionSize & 3)) & 3;
+
+    sect_offset = fileEntry->current_size;
+    sect_len = sizeof(s_plf_section) + payload_len + bytes_to_skip;
+
+    newSctIdx = plf_int_add_entry(ctx, fileIdx, &newSection, sect_offset + sizeof(s_plf_section));
+    if (newSctIdx < 0)
+        return newSctIdx;
+
+    retval = PLF_E_IO;
+
+    if (fileEntry->fildes == -1
+            || (fileEntry->wbuf_size > 0 && sect_len <= fileEntry->wbuf_size - fileEntry->wbuf_len
+                && (fileEntry->wbuf_len == 0 || fileEntry->wbuf_offset + fileEntry->wbuf_len == sect_offset)))
+    {
+        /* In memory or fits into the write buffer: no system call needed */
+        u64 offset = sect_offset;
+
+        if (plf_int_write(ctx, fileIdx, &newSection, offset, sizeof(s_plf_section)) != sizeof(s_plf_section))
+            goto plf_ctx_write_section_ex_exit;
+        offset += sizeof(s_plf_section);
+
+        for (i = 0; i < iovcnt; ++i)
+        {
+            if (iov[i].iov_len > 0
+                    && plf_int_write(ctx, fileIdx, iov[i].iov_base, offset, iov[i].iov_len) != iov[i].iov_len)
+                goto plf_ctx_write_section_ex_exit;
+            offset += iov[i].iov_len;
+        }
+
+        if (bytes_to_skip > 0
+                && plf_int_write(ctx, fileIdx, &padding, offset, bytes_to_skip) != bytes_to_skip)
+            goto plf_ctx_write_section_ex_exit;
+    }
+    else
+    {
+        u64 write_offset = sect_offset;
+
+        /* Buffered data not directly in front can't go along */
+        if (fileEntry->wbuf_len > 0 && fileEntry->wbuf_offset + fileEntry->wbuf_len != sect_offset
+                && plf_int_flush(ctx, fileIdx) < 0)
+            goto plf_ctx_write_section_ex_exit;
+
+        out_iov = (struct iovec*) malloc((iovcnt + 3) * sizeof(struct iovec));
+        if (out_iov == 0)
+        {
+            retval = PLF_E_MEM;
+            goto plf_ctx_write_section_ex_exit;
+        }
+
+        out_cnt = 0;
+
+        /* Buffered data, header, payload and padding with one call */
+        if (fileEntry->wbuf_len > 0)
+        {
+            out_iov[out_cnt].iov_base = fileEntry->wbuf;
+            out_iov[out_cnt].iov_len = fileEntry->wbuf_len;
+            write_offset = fileEntry->wbuf_offset;
+            ++out_cnt;
+        }
+
+        out_iov[out_cnt].iov_base = &newSection;
+        out_iov[out_cnt].iov_len = sizeof(s_plf_section);
+        ++out_cnt;
+
+        for (i = 0; i < iovcnt; ++i)
+            out_iov[out_cnt++] = iov[i];
+
+        out_iov[out_cnt].iov_base = &padding;
+        out_iov[out_cnt].iov_len = bytes_to_skip;
+        ++out_cnt;
+
+        retval = plf_int_writev(fileEntry->fildes, out_iov, out_cnt, write_offset);
+        free(out_iov);
+
+        if (retval < 0)
+            goto plf_ctx_write_section_ex_exit;
+
+        fileEntry->wbuf_len = 0;
+    }
+
+    fileEntry->current_size += sect_len;
+
+    return newSctIdx;
+
+plf_ctx_write_section_ex_exit:
+    /* The section wasn't written, current_size still points to its start */
+    fileEntry->num_entries = newSctIdx;
+
+    return retval;
+}
+
+/*
+ * Append a section of another file. The content is copied by the kernel if
+ * both files are on disk, from memory if the source is a RAM or mapped file.
+ */
+int plf_ctx_copy_section(s_plf_ctx* ctx, int srcIdx, int sectIdx, int dstIdx)
+{
+    return plf_ctx_copy_section_ex(ctx, srcIdx, sectIdx, dstIdx, 0);
+}
+
+/*
+ * Append a section of another file, flags see PLF_WRITE_xxx
+ */
+int plf_ctx_copy_section_ex(s_plf_ctx* ctx, int srcIdx, int sectIdx, int dstIdx, u32 flags)
+{
+    s_plf_file_entry* srcEntry;
+    s_plf_file_entry* dstEntry;
+    s_plf_section* srcSection;
+    s_plf_section newSection;
+    u64 src_offset, dst_offset;
+    u64 bytes_copied = 0;
+    u32 padding = 0;
+    u32 bytes_to_skip;
+    int newSctIdx, retval;
+
+    PLF_GET_FILE_ENTRY(srcEntry, srcIdx);
+    PLF_GET_FILE_ENTRY(dstEntry, dstIdx);
+
+    if (srcEntry == dstEntry)
+        return PLF_E_PARAM;
+
+    srcSection = plf_int_get_section(ctx, srcIdx, sectIdx);
+    if (srcSection == 0)
+        return PLF_E_PARAM;
+
+    /* Check if this filentry is writable */
+    if ( (dstEntry->flags & PLF_FILE_FLAG_WRITE) == 0)
+        return PLF_E_WRITE;
+
+    /* Check if section previous section is closed */
+    if ( (dstEntry->flags & PLF_FILE_FLAG_SECTOPEN) != 0)
+        return PLF_E_OPENED;
+
+    newSection = *srcSection;
+
+    /* Checked up front: the kernel copy below doesn't pass the data through here */
+    if (flags & PLF_WRITE_VERIFY_CRC)
+    {
+        retval = plf_ctx_check_crc(ctx, srcIdx, sectIdx);
+        if (retval < 0)
+            return retval;
+    }
+
+    /* The CRC of the source is only taken if it was checked, or if the caller says so */
+    if ((flags & PLF_WRITE_KEEP_CRC) == 0 && srcEntry->sect_state[sectIdx] != PLF_SECT_CRC_OK)
+    {
+        retval = plf_int_calc_crc(ctx, srcIdx, sectIdx, 1, &newSection.dwCRC32);
+        if (retval < 0)
+            return retval;
+    }
+
+    src_offset = srcEntry->sect_offset[sectIdx];
+    dst_offset = dstEntry->current_size + sizeof(s_plf_section);
+    bytes_to_skip = (4 - (newSection.dwSectionSize & 3)) & 3;
+
+    newSctIdx = plf_int_add_entry(ctx, dstIdx, &newSection, dst_offset);
+    if (newSctIdx < 0)
+        return newSctIdx;
+
+    retval = PLF_E_IO;
+
+    if (plf_int_write(ctx, dstIdx, &newSection, dstEntry->current_size, sizeof(s_plf_section)) != sizeof(s_plf_section))
+        goto plf_ctx_copy_section_ex_exit;
+
+    if (srcEntry->fildes == -1)
+    {
+        /* Source in memory: write it from there */
+        if (src_offset > srcEntry->buffer_size
+                || newSection.dwSectionSize > srcEntry->buffer_size - src_offset)
+            goto plf_ctx_copy_section_ex_exit;
+
+        /* In pieces, a single write is limited to an int */
+        while (bytes_copied < newSection.dwSectionSize)
+        {
+            u32 copy_len = newSection.dwSectionSize - bytes_copied;
+
+            if (copy_len > PLF_COPY_CHUNK)
+                copy_len = PLF_COPY_CHUNK;
+
+            if (plf_int_write(ctx, dstIdx, (const u8*) srcEntry->buffer + src_offset + bytes_copied,
+                    dst_offset + bytes_copied, copy_len) != copy_len)
+                goto plf_ctx_copy_section_ex_exit;
+
+            bytes_copied += copy_len;
+        }
+    }
+    else if (dstEntry->fildes != -1)
+    {
+        /* Both on disk: the header has to be in the file first */
+        if (dstEntry->wbuf_len > 0 && plf_int_flush(ctx, dstIdx) < 0)
+            goto plf_ctx_copy_section_ex_exit;
+
+        if (srcEntry->wbuf_len > 0 && plf_int_flush(ctx, srcIdx) < 0)
+            goto plf_ctx_copy_section_ex_exit;
+
+        bytes_copied = plf_int_copy_fd(srcEntry->fildes, srcEntry->window_offset + src_offset,
+                dstEntry->fildes, dst_offset, newSection.dwSectionSize);
+    }
+
+    /* Whatever the kernel couldn't copy */
+    if (bytes_copied < newSection.dwSectionSize)
+    {
+        u8* copy_buf = (u8*) malloc(PLF_COPY_CHUNK);
+
+        if (copy_buf == 0)
+        {
+            retval = PLF_E_MEM;
+            goto plf_ctx_copy_section_ex_exit;
+        }
+
+        while (bytes_copied < newSection.dwSectionSize)
+        {
+            u32 copy_len = newSection.dwSectionSize - bytes_copied;
+            s64 bytes_read;
+
+            if (copy_len > PLF_COPY_CHUNK)
+                copy_len = PLF_COPY_CHUNK;
+
+            bytes_read = plf_int_read(ctx, srcIdx, copy_buf, src_offset + bytes_copied, copy_len);
+            if (bytes_read != copy_len
+                    || plf_int_write(ctx, dstIdx, copy_buf, dst_offset + bytes_copied, copy_len) != copy_len)
+            {
+                free(copy_buf);
+                goto plf_ctx_copy_section_ex_exit;
+            }
+
+            bytes_copied += copy_len;
+        }
+
+        free(copy_buf);
+    }
+
+    /* Align */
+    if (bytes_to_skip > 0
+            && plf_int_write(ctx, dstIdx, &padding, dst_offset + newSection.dwSectionSize, bytes_to_skip) != bytes_to_skip)
+        goto plf_ctx_copy_section_ex_exit;
+
+    dstEntry->current_size = dst_offset + newSection.dwSectionSize + bytes_to_skip;
+
+    return newSctIdx;
+
+plf_ctx_copy_section_ex_exit:
+    /* The section wasn't copied, current_size still points to its start */
+    dstEntry->num_entries = newSctIdx;
+
+    return retval;
+}
+
+/*
+ * Write the raw content of a section to fd, at its current position.
+ * Returns the number of bytes written.
+ */
+s64 plf_ctx_extract_section_to_fd(s_plf_ctx* ctx, int fileIdx, int sectIdx, int fd)
+{
+    return plf_ctx_extract_section_to_fd_ex(ctx, fileIdx, sectIdx, fd, 0);
+}
+
+/*
+ * With PLF_WRITE_VERIFY_CRC the section is checked while it is written to fd,
+ * instead of being read once by plf_check_crc() and once more for the copy.
+ * If the CRC doesn't match, fd is truncated back to where the section began.
+ */
+s64 plf_ctx_extract_section_to_fd_ex(s_plf_ctx* ctx, int fileIdx, int sectIdx, int fd, u32 flags)
+{
+    s_plf_file_entry* fileEntry;
+    s_plf_section* section;
+    u64 offset;
+    u64 bytes_copied = 0;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+    section = plf_int_get_section(ctx, fileIdx, sectIdx);
+
+    if (section == 0 || fd < 0)
+        return PLF_E_PARAM;
+
+    if (flags & PLF_WRITE_VERIFY_CRC)
+    {
+        if (fileEntry->sect_state[sectIdx] == PLF_SECT_CRC_BAD)
+            return PLF_E_CRC;
+
+        /* Checked before: the kernel may copy it */
+        if (fileEntry->sect_state[sectIdx] != PLF_SECT_CRC_OK)
+            return plf_int_extract_verified(ctx, fileIdx, sectIdx, fd);
+    }
+
+    offset = fileEntry->sect_offset[sectIdx];
+
+    if (fileEntry->fildes == -1)
+    {
+        /* Already in memory */
+        if (offset > fileEntry->buffer_size
+                || section->dwSectionSize > fileEntry->buffer_size - offset)
+            return PLF_E_IO;
+
+        while (bytes_copied < section->dwSectionSize)
+        {
+            u32 write_len = section->dwSectionSize - bytes_copied;
+            int bytes_written;
+
+            if (write_len > PLF_IO_CHUNK)
+                write_len = PLF_IO_CHUNK;
+
+            bytes_written = write(fd, (const u8*) fileEntry->buffer + offset + bytes_copied, write_len);
+            if (bytes_written <= 0)
+                return PLF_E_IO;
+
+            bytes_copied += bytes_written;
+        }
+
+        return bytes_copied;
+    }
+
+    if (fileEntry->wbuf_len > 0 && plf_int_flush(ctx, fileIdx) < 0)
+        return PLF_E_IO;
+
+    bytes_copied = plf_int_copy_fd(fileEntry->fildes, fileEntry->window_offset + offset, fd, -1,
+            section->dwSectionSize);
+
+    /* Whatever the kernel couldn't copy */
+    if (bytes_copied < section->dwSectionSize)
+    {
+        u8* copy_buf = (u8*) malloc(PLF_COPY_CHUNK);
+
+        if (copy_buf == 0)
+            return PLF_E_MEM;
+
+        while (bytes_copied < section->dwSectionSize)
+        {
+            u32 copy_len = section->dwSectionSize - bytes_copied;
+            u32 bytes_done = 0;
+
+            if (copy_len > PLF_COPY_CHUNK)
+                copy_len = PLF_COPY_CHUNK;
+
+            if (plf_int_read(ctx, fileIdx, copy_buf, offset + bytes_copied, copy_len) != copy_len)
+            {
+                free(copy_buf);
+                return PLF_E_IO;
+            }
+
+            while (bytes_done < copy_len)
+            {
+                int bytes_written = write(fd, copy_buf + bytes_done, copy_len - bytes_done);
+
+                if (bytes_written <= 0)
+                {
+                    free(copy_buf);
+                    return PLF_E_IO;
+                }
+
+                bytes_done += bytes_written;
+            }
+
+            bytes_copied += copy_len;
+        }
+
+        free(copy_buf);
+    }
+
+    return bytes_copied;
+}
+
+/*
+ * Extraction with PLF_WRITE_VERIFY_CRC: every chunk is added to the CRC and
+ * written to fd right after it was read
+ */
+static s64 plf_int_extract_verified(s_plf_ctx* ctx, int fileIdx, int sectIdx, int fd)
+{
+    s_plf_file_entry* fileEntry;
+    s_plf_section* section;
+    u8* copy_buf = 0;
+    off_t start_pos;
+    u32 crc_accum = 0;
+    u32 crc_num_size = 0;
+    u32 bytes_copied = 0;
+    int retval = 0;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+    section = plf_int_get_section(ctx, fileIdx, sectIdx);
+
+    if (section == 0)
+        return PLF_E_PARAM;
+
+    if (fileEntry->fildes == -1)
+    {
+        if (fileEntry->sect_offset[sectIdx] > fileEntry->buffer_size
+                || section->dwSectionSize > fileEntry->buffer_size - fileEntry->sect_offset[sectIdx])
+            return PLF_E_IO;
+    }
+    else
+    {
+        copy_buf = (u8*) malloc(PLF_COPY_CHUNK);
+
+        if (copy_buf == 0)
+            return PLF_E_MEM;
+    }
+
+    /* Where to roll back to, -1 for pipes */
+    start_pos = lseek(fd, 0, SEEK_CUR);
+
+    while (bytes_copied < section->dwSectionSize && retval == 0)
+    {
+        u32 copy_len = section->dwSectionSize - bytes_copied;
+        u32 bytes_done = 0;
+        const u8* chunk;
+
+        if (copy_len > PLF_COPY_CHUNK)
+            copy_len = PLF_COPY_CHUNK;
+
+        if (copy_buf == 0)
+        {
+            chunk = (const u8*) fileEntry->buffer + fileEntry->sect_offset[sectIdx] + bytes_copied;
+        }
+        else
+        {
+            int bytes_read = plf_ctx_get_payload_raw(ctx, fileIdx, sectIdx, copy_buf, bytes_copied, copy_len);
+
+            if (bytes_read < (int) copy_len)
+            {
+                retval = (bytes_read < 0) ? bytes_read : PLF_E_IO;
+                break;
+            }
+
+            chunk = copy_buf;
+        }
+
+        crc32_calc_buffer(&crc_accum, &crc_num_size, chunk, copy_len);
+
+        while (bytes_done < copy_len)
+        {
+            int bytes_written = write(fd, chunk + bytes_done, copy_len - bytes_done);
+
+            if (bytes_written <= 0)
+            {
+                retval = PLF_E_IO;
+                break;
+            }
+
+            bytes_done += bytes_written;
+        }
+
+        bytes_copied += bytes_done;
+    }
+
+    free(copy_buf);
+
+    if (retval == 0)
+    {
+        crc32_calc_dw(&crc_accum, &crc_num_size);
+        retval = (crc_accum == section->dwCRC32) ? 0 : PLF_E_CRC;
+
+        plf_int_set_crc_state(fileEntry, sectIdx, retval == 0);
+    }
+
+    if (retval < 0)
+    {
+        if (start_pos >= 0 && ftruncate(fd, start_pos) == 0)
+            lseek(fd, start_pos, SEEK_SET);
+
+        return retval;
+    }
+
+    return bytes_copied;
+}
+
+/*
+ * Overwrite len bytes of a section from offset on. The CRC is updated from
+ * the old and new bytes only, the rest of the section isn't read.
+ */
+int plf_ctx_patch_payload(s_plf_ctx* ctx, int fileIdx, int sectIdx, u32 offset, const void* data, u32 len)
+{
+    s_plf_file_entry* fileEntry;
+    s_plf_section* section;
+    u8* old_buf;
+    u32 buf_size, done;
+    int retval = 0;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+    section = plf_int_get_section(ctx, fileIdx, sectIdx);
+
+    if (section == 0 || (data == 0 && len > 0))
+        return PLF_E_PARAM;
+
+    /* Opened with PLF_OPEN_PATCH, or being written */
+    if ((fileEntry->flags & (PLF_FILE_FLAG_PATCH | PLF_FILE_FLAG_WRITE)) == 0)
+        return PLF_E_WRITE;
+
+    /* The open section gets its CRC from plf_finish_section() */
+    if ((fileEntry->flags & PLF_FILE_FLAG_SECTOPEN) && (u32) sectIdx + 1 == fileEntry->num_entries)
+        return PLF_E_OPENED;
+
+    if (offset > section->dwSectionSize || len > section->dwSectionSize - offset)
+        return PLF_E_PARAM;
+
+    if (len == 0)
+        return 0;
+
+    buf_size = (len < PLF_COPY_CHUNK) ? len : PLF_COPY_CHUNK;
+    old_buf = (u8*) malloc(buf_size);
+
+    if (old_buf == 0)
+        return PLF_E_MEM;
+
+    for (done = 0; done < len && retval == 0; done += buf_size)
+    {
+        const u8* new_data = (const u8*) data + done;
+        int bytes_read;
+
+        if (buf_size > len - done)
+            buf_size = len - done;
+
+        bytes_read = plf_ctx_get_payload_raw(ctx, fileIdx, sectIdx, old_buf, offset + done, buf_size);
+        if (bytes_read < (int) buf_size)
+        {
+            retval = (bytes_read < 0) ? bytes_read : PLF_E_IO;
+            break;
+        }
+
+        section->dwCRC32 = crc32_update_range(section->dwCRC32, section->dwSectionSize, offset + done,
+                old_buf, new_data, buf_size);
+
+        if (plf_int_write(ctx, fileIdx, new_data, fileEntry->sect_offset[sectIdx] + offset + done, buf_size)
+                != buf_size)
+            retval = PLF_E_IO;
+    }
+
+    free(old_buf);
+
+    /* Header after the data, as plf_finish_section() does */
+    if (plf_int_write(ctx, fileIdx, section, fileEntry->sect_offset[sectIdx] - sizeof(s_plf_section),
+            sizeof(s_plf_section)) != sizeof(s_plf_section) && retval == 0)
+        retval = PLF_E_IO;
+
+    /* The index was made for the file as it was opened */
+    fileEntry->flags &= ~(PLF_FILE_FLAG_INDEX | PLF_FILE_FLAG_IDXDIRTY);
+
+    return retval;
+}
+
+/*
+ * Size of the write buffer, see PLF_WRITE_BUFFER_SIZE
+ */
+int plf_ctx_set_write_buffer(s_plf_ctx* ctx, int fileIdx, u32 size)
+{
+    s_plf_file_entry* fileEntry;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    /* Check if this filentry is writable */
+    if ( (fileEntry->flags & PLF_FILE_FLAG_WRITE) == 0)
+        return PLF_E_WRITE;
+
+    /* Files in memory are written directly anyway */
+    if (fileEntry->fildes == -1)
+        return 0;
+
+    if (fileEntry->wbuf_len > 0 && plf_int_flush(ctx, fileIdx) < 0)
+        return PLF_E_IO;
+
+    free(fileEntry->wbuf);
+    fileEntry->wbuf = 0;
+    fileEntry->wbuf_size = size;
+
+    return 0;
+}
+
+/*
+ * API on the default context
+ */
+int plf_create_file(const char* filename)
+{
+    return plf_ctx_create_file(&plf_default_ctx, filename);
+}
+
+int plf_create_ram(void* buffer, u32 buffer_size)
+{
+    return plf_ctx_create_ram(&plf_default_ctx, buffer, buffer_size);
+}
+
+int plf_detach_ram(int fileIdx, void** buffer, u64* buffer_size)
+{
+    return plf_ctx_detach_ram(&plf_default_ctx, fileIdx, buffer, buffer_size);
+}
+
+int plf_set_index_dir(const char* dir)
+{
+    return plf_ctx_set_index_dir(&plf_default_ctx, dir);
+}
+
+int plf_open_file(const char* filename)
+{
+    return plf_ctx_open_file(&plf_default_ctx, filename);
+}
+
+int plf_open_file_ex(const char* filename, u32 flags)
+{
+    return plf_ctx_open_file_ex(&plf_default_ctx, filename, flags);
+}
+
+int plf_open_ram(const void* buffer, u32 buffer_size)
+{
+    return plf_ctx_open_ram(&plf_default_ctx, buffer, buffer_size);
+}
+
+int plf_open_ram_64(const void* buffer, u64 buffer_size)
+{
+    return plf_ctx_open_ram_64(&plf_default_ctx, buffer, buffer_size);
+}
+
+int plf_open_section(int parentIdx, int sectIdx)
+{
+    return plf_ctx_open_section(&plf_default_ctx, parentIdx, sectIdx);
+}
+
+int plf_get_num_sections(int fileIdx)
+{
+    return plf_ctx_get_num_sections(&plf_default_ctx, fileIdx);
+}
+
+int plf_check_crc(int fileIdx, int entryIdx)
+{
+    return plf_ctx_check_crc(&plf_default_ctx, fileIdx, entryIdx);
+}
+
+int plf_verify(int fileIdx)
+{
+    return plf_ctx_verify(&plf_default_ctx, fileIdx);
+}
+
+int plf_verify_parallel(int fileIdx, int nthreads, int* results)
+{
+    return plf_ctx_verify_parallel(&plf_default_ctx, fileIdx, nthreads, results);
+}
+
+int plf_begin_section(int fileIdx)
+{
+    return plf_ctx_begin_section(&plf_default_ctx, fileIdx);
+}
+
+int plf_write_payload(int fileIdx, int sectIndx, const void* buffer, u32 len, u8 compress)
+{
+    return plf_ctx_write_payload(&plf_default_ctx, fileIdx, sectIndx, buffer, len, compress);
+}
+
+int plf_finish_section(int fileIdx, int sectIdx)
+{
+    return plf_ctx_finish_section(&plf_default_ctx, fileIdx, sectIdx);
+}
+
+int plf_write_section(int fileIdx, const s_plf_section* hdr, const struct iovec* iov, int iovcnt)
+{
+    return plf_ctx_write_section(&plf_default_ctx, fileIdx, hdr, iov, iovcnt);
+}
+
+int plf_write_section_ex(int fileIdx, const s_plf_section* hdr, const struct iovec* iov, int iovcnt, u32 flags)
+{
+    return plf_ctx_write_section_ex(&plf_default_ctx, fileIdx, hdr, iov, iovcnt, flags);
+}
+
+int plf_copy_section(int srcIdx, int sectIdx, int dstIdx)
+{
+    return plf_ctx_copy_section(&plf_default_ctx, srcIdx, sectIdx, dstIdx);
+}
+
+int plf_copy_section_ex(int srcIdx, int sectIdx, int dstIdx, u32 flags)
+{
+    return plf_ctx_copy_section_ex(&plf_default_ctx, srcIdx, sectIdx, dstIdx, flags);
+}
+
+s64 plf_extract_section_to_fd(int fileIdx, int sectIdx, int fd)
+{
+    return plf_ctx_extract_section_to_fd(&plf_default_ctx, fileIdx, sectIdx, fd);
+}
+
+s64 plf_extract_section_to_fd_ex(int fileIdx, int sectIdx, int fd, u32 flags)
+{
+    return plf_ctx_extract_section_to_fd_ex(&plf_default_ctx, fileIdx, sectIdx, fd, flags);
+}
+
+int plf_patch_payload(int fileIdx, int sectIdx, u32 offset, const void* data, u32 len)
+{
+    return plf_ctx_patch_payload(&plf_default_ctx, fileIdx, sectIdx, offset, data, len);
+}
+
+int plf_set_write_buffer(int fileIdx, u32 size)
+{
+    return plf_ctx_set_write_buffer(&plf_default_ctx, fileIdx, size);
+}
+
+int plf_get_payload_raw(int fileIdx, int sectIdx, void* dst_buffer, u32 offset, u32 len)
+{
+    return plf_ctx_get_payload_raw(&plf_default_ctx, fileIdx, sectIdx, dst_buffer, offset, len);
+}
+
+s64 plf_get_payload_raw_64(int fileIdx, int sectIdx, void* dst_buffer, u64 offset, u64 len)
+{
+    return plf_ctx_get_payload_raw_64(&plf_default_ctx, fileIdx, sectIdx, dst_buffer, offset, len);
+}
+
+s64 plf_get_section_offset_64(int fileIdx, int sectIdx)
+{
+    return plf_ctx_get_section_offset_64(&plf_default_ctx, fileIdx, sectIdx);
+}
+
+s64 plf_get_file_size_64(int fileIdx)
+{
+    return plf_ctx_get_file_size_64(&plf_default_ctx, fileIdx);
+}
+
+int plf_get_payload_uncompressed(int fileIdx, int sectIdx, void** buffer, u32* buffer_size)
+{
+    return plf_ctx_get_payload_uncompressed(&plf_default_ctx, fileIdx, sectIdx, buffer, buffer_size);
+}
+
+int plf_get_payload_view(int fileIdx, int sectIdx, const void** payload, u32* len)
+{
+    return plf_ctx_get_payload_view(&plf_default_ctx, fileIdx, sectIdx, payload, len);
+}
+
+int plf_release_payload_view(int fileIdx, const void* payload)
+{
+    return plf_ctx_release_payload_view(&plf_default_ctx, fileIdx, payload);
+}
+
+s_plf_section* plf_get_section_header(int fileIdx, int sectIdx)
+{
+    return plf_ctx_get_section_header(&plf_default_ctx, fileIdx, sectIdx);
+}
+
+s_plf_file* plf_get_file_header(int fileIdx)
+{
+    return plf_ctx_get_file_header(&plf_default_ctx, fileIdx);
+}
+
+int plf_close(int fileIdx)
+{
+    return plf_ctx_close(&plf_default_ctx, fileIdx);
+}
+
+int plf_write_index(int fileIdx)
+{
+    return plf_ctx_write_index(&plf_default_ctx, fileIdx);
+}
+
+
+/*
+ * Create a new file.
+ */
+static int plf_int_new_file(s_plf_ctx* ctx)
+{
+    int slot;
+    s_plf_file_entry* fileEntry;
+
+    if (ctx == 0)
+        return PLF_E_PARAM;
+
+    if (ctx->pool.free_slot >= 0)
+    {
+        /* Reuse a closed entry */
+        slot = ctx->pool.free_slot;
+        fileEntry = ctx->pool.files[slot];
+        ctx->pool.free_slot = fileEntry->next_free;
+    }
+    else
+    {
+        /* No free entry left, add a new one */
+        if (ctx->pool.num_slots >= PLF_HANDLE_MAX_SLOTS)
+            return PLF_E_NO_SPACE;
+
+        if (ctx->pool.num_slots >= ctx->pool.max_slots)
+        {
+            u32 new_max = ctx->pool.max_slots * 2;
+            s_plf_file_entry** new_files;
+
+            if (new_max < PLF_MIN_FILE_SLOTS)
+                new_max = PLF_MIN_FILE_SLOTS;
+
+            new_files = (s_plf_file_entry**) realloc(ctx->pool.files, new_max * sizeof(s_plf_file_entry*));
+            if (new_files == 0)
+                return PLF_E_MEM;
+
+            ctx->pool.files = new_files;
+            ctx->pool.max_slots = new_max;
+        }
+
+        fileEntry = (s_plf_file_entry*) malloc(sizeof(s_plf_file_entry));
+        if (fileEntry == 0)
+            return PLF_E_MEM;
+
+        fileEntry->generation = 0;
+
+        slot = ctx->pool.num_slots++;
+        ctx->pool.files[slot] = fileEntry;
+    }
+
+    /* Init this entry */
+    fileEntry->buffer = 0;
+    fileEntry->buffer_size = 0;
+    fileEntry->sect_hdr = 0;
+    fileEntry->sect_offset = 0;
+    fileEntry->fildes = -1;
+    fileEntry->num_entries = 0;
+    fileEntry->max_entries = 0;
+    fileEntry->flags = PLF_FILE_FLAG_INUSE;
+    fileEntry->current_size = 0;
+    fileEntry->next_free = -1;
+    fileEntry->window_offset = 0;
+    fileEntry->window_size = 0;
+    fileEntry->scan_offset = 0;
+    fileEntry->scan_end = 0;
+    fileEntry->sect_state = 0;
+    fileEntry->idx_path = 0;
+    memset(&fileEntry->idx_key, 0, sizeof(s_plf_idx_key));
+    fileEntry->wbuf = 0;
+    fileEntry->wbuf_size = 0;
+    fileEntry->wbuf_len = 0;
+    fileEntry->wbuf_offset = 0;
+    fileEntry->gz_stream = 0;
+
+    fileEntry->hdr.dwMagic = PLF_MAGIC_CODE;
+
+    /* Found a free index */
+    return PLF_HANDLE(slot, fileEntry->generation);
+}
+
+
+/*
+ * Look up the entry of a handle, 0 if closed or stale
+ */
+static s_plf_file_entry* plf_int_get_file(s_plf_ctx* ctx, int fileIdx)
+{
+    s_plf_file_entry* fileEntry;
+    u32 slot;
+
+    if (ctx == 0 || fileIdx < 0)
+        return 0;
+
+    slot = PLF_HANDLE_SLOT(fileIdx);
+    if (slot >= ctx->pool.num_slots)
+        return 0;
+
+    fileEntry = ctx->pool.files[slot];
+
+    /* Closed, or handle of an earlier file in this slot */
+    if ((fileEntry->flags & PLF_FILE_FLAG_INUSE) == 0
+            || fileEntry->generation != PLF_HANDLE_GEN(fileIdx))
+        return 0;
+
+    return fileEntry;
+}
+
+
+static s_plf_section* plf_int_get_section(s_plf_ctx* ctx, int fileIdx, int sectIdx)
+{
+    s_plf_file_entry* fileEntry = plf_int_get_file(ctx, fileIdx);
+
+    if (fileEntry == 0)
+        return 0;
+
+    if (sectIdx < 0)
+        return 0;
+
+    /* Not found yet (PLF_OPEN_LAZY) */
+    if ((u32) sectIdx >= fileEntry->num_entries
+            && plf_int_read_entries(ctx, fileIdx, sectIdx) < 0)
+        return 0;
+
+    if ((u32) sectIdx >= fileEntry->num_entries)
+        return 0;
+
+    return &(fileEntry->sect_hdr[sectIdx]);
+}
+
+/*
+ * Read the section headers until section sectIdx is known or the end of the
+ * file is reached (PLF_SCAN_ALL). Every call continues where the previous
+ * one stopped, see PLF_OPEN_LAZY.
+ * Files are read in windows of PLF_SCAN_WINDOW bytes, all headers within a
+ * window are taken without further reads. Only payloads larger than the
+ * window cause a read at a new position.
+ */
+static int plf_int_read_entries(s_plf_ctx* ctx, int fileIdx, u32 sectIdx)
+{
+    s_plf_file_entry* fileEntry;
+    s_plf_section* tmpSection = 0;
+    u64 current_offset;
+    u8* scan_buf = 0;
+    u32 scan_buf_size = PLF_SCAN_WINDOW;
+    u64 scan_buf_pos = 0;
+    u32 scan_buf_len = 0;
+    int ret_val = 0;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    /* Check if entries are already read */
+    if ( (fileEntry->flags & PLF_FILE_FLAG_OPENED) != 0)
+        return 0;
+
+    if (fileEntry->fildes != -1)
+    {
+        /* allocate the readahead buffer, a header has to fit in after aligning */
+        if (fileEntry->hdr.dwSectHdrSize > scan_buf_size - PLF_SCAN_ALIGN)
+            scan_buf_size = fileEntry->hdr.dwSectHdrSize + PLF_SCAN_ALIGN;
+
+        scan_buf = (u8*) malloc(scan_buf_size);
+
+        if (scan_buf == 0)
+            return PLF_E_MEM;
+    }
+
+    current_offset = fileEntry->scan_offset;
+
+    while (current_offset < fileEntry->scan_end)
+    {
+        u64 section_offset_start = current_offset;
+        u64 file_offset = fileEntry->window_offset + current_offset;
+
+        /* Check if entry header is available */
+        if (current_offset + fileEntry->hdr.dwSectHdrSize
+                > fileEntry->scan_end)
+            break;
+
+        if (fileEntry->fildes == -1)
+        {
+            if (fileEntry->num_entries > sectIdx)
+                break;
+
+            /* Entry header in RAM */
+            tmpSection = (s_plf_section*) ((u8*) (fileEntry->buffer)
+                    + current_offset);
+        }
+        else
+        {
+            if (file_offset < scan_buf_pos
+                    || file_offset + fileEntry->hdr.dwSectHdrSize > scan_buf_pos + scan_buf_len)
+            {
+                int read_bytes;
+
+                /* Found sectIdx and the next header needs another read */
+                if (fileEntry->num_entries > sectIdx)
+                    break;
+
+                /* read the next window */
+                scan_buf_pos = file_offset & ~((u64) PLF_SCAN_ALIGN - 1);
+                read_bytes = plf_pread(fileEntry->fildes, scan_buf, scan_buf_size, scan_buf_pos);
+                scan_buf_len = (read_bytes < 0) ? 0 : read_bytes;
+
+                /* check if at least the header was read */
+                if (file_offset + fileEntry->hdr.dwSectHdrSize > scan_buf_pos + scan_buf_len)
+                    break;
+            }
+
+            /* Entry header in the readahead buffer */
+            tmpSection = (s_plf_section*) (scan_buf + (file_offset - scan_buf_pos));
+        }
+
+        /* Skip header and payload */
+        current_offset += fileEntry->hdr.dwSectHdrSize
+                + tmpSection->dwSectionSize;
+
+        /* Check if payload is completely available */
+        if (current_offset > fileEntry->scan_end)
+            break;
+
+        /* Add entry */
+        ret_val = plf_int_add_entry(ctx, fileIdx, tmpSection,
+                fileEntry->hdr.dwSectHdrSize + section_offset_start);
+        if (ret_val < 0)
+        {
+            /* Try this one again next time */
+            current_offset = section_offset_start;
+            break;
+        }
+
+        /* Align */
+        int bytes_to_seek = 4 - (tmpSection->dwSectionSize & 3);
+        if (bytes_to_seek != 4)
+        {
+            current_offset += bytes_to_seek;
+        }
+    }
+
+    fileEntry->scan_offset = current_offset;
+
+    /* Stopped before finding sectIdx: all sections are known */
+    if (ret_val >= 0 && fileEntry->num_entries <= sectIdx)
+        fileEntry->flags |= PLF_FILE_FLAG_OPENED;
+
+    free(scan_buf);
+
+    return (ret_val < 0) ? ret_val : 0;
+}
+
+
+/*
+ * Write the header of a new file, sections are added from then on
+ */
+static int plf_int_create(s_plf_ctx* ctx, int fileIdx)
+{
+    s_plf_file_entry* fileEntry;
+    int bytes_written;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    memset(&fileEntry->hdr, 0, sizeof(s_plf_file));
+    fileEntry->hdr.dwMagic = PLF_MAGIC_CODE;
+    fileEntry->hdr.dwHdrSize = sizeof(s_plf_file);
+    fileEntry->hdr.dwSectHdrSize = sizeof(s_plf_section);
+    fileEntry->hdr.dwHdrVersion = 0x0A;
+
+    bytes_written = plf_int_write(ctx, fileIdx, &(fileEntry->hdr), 0, sizeof(s_plf_file));
+
+    if (bytes_written != sizeof(s_plf_file))
+    {
+        plf_ctx_close(ctx, fileIdx);
+        return (bytes_written < 0) ? bytes_written : PLF_E_IO;
+    }
+
+    fileEntry->current_size = bytes_written;
+
+    /* No sections to read in a new file */
+    fileEntry->flags |= PLF_FILE_FLAG_WRITE | PLF_FILE_FLAG_OPENED;
+
+    return fileIdx;
+}
+
+/*
+ * Open entry point of the file. This section is a s_plf_file (see plf_structs.h)
+ */
+static int plf_int_open_file(s_plf_ctx* ctx, int fileIdx)
+{
+    int retval;
+    s_plf_file_entry* fileEntry;
+    int bytes_read;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    bytes_read = plf_int_read(ctx, fileIdx, (void*) (&fileEntry->hdr), 0,
+            sizeof(s_plf_file));
+
+    if (bytes_read != sizeof(s_plf_file))
+    {
+        plf_ctx_close(ctx, fileIdx);
+        return PLF_E_IO;
+    }
+
+    /* Not a PLF file */
+    if (fileEntry->hdr.dwMagic != PLF_MAGIC_CODE)
+    {
+        plf_ctx_close(ctx, fileIdx);
+        return PLF_E_FILE_IDX;
+    }
+
+    /* Fill unused bytes */
+    if (fileEntry->hdr.dwHdrSize < sizeof(s_plf_file))
+    {
+        u8* p_start = ((u8*) (&fileEntry->hdr)) + fileEntry->hdr.dwHdrSize;
+        u32 fill_size = sizeof(s_plf_file) - fileEntry->hdr.dwHdrSize;
+        memset(p_start, 0, fill_size);
+    }
+
+    /* Sections start after the header and end with the file */
+    if (fileEntry->fildes == -1)
+    {
+        fileEntry->scan_offset = sizeof(s_plf_file);
+        fileEntry->scan_end = fileEntry->buffer_size;
+    }
+    else if (fileEntry->flags & PLF_FILE_FLAG_WINDOW)
+    {
+        fileEntry->scan_offset = fileEntry->hdr.dwHdrSize;
+        fileEntry->scan_end = fileEntry->window_size;
+    }
+    else
+    {
+        struct stat file_stat;
+
+        if (fstat(fileEntry->fildes, &file_stat) < 0)
+        {
+            plf_ctx_close(ctx, fileIdx);
+            return PLF_E_IO;
+        }
+
+        fileEntry->scan_offset = fileEntry->hdr.dwHdrSize;
+        fileEntry->scan_end = file_stat.st_size;
+    }
+
+    /* Section table from the index, if there is a valid one */
+    if ((fileEntry->flags & PLF_FILE_FLAG_INDEX)
+            && plf_int_load_index(ctx, fileIdx) < 0)
+    {
+        fileEntry->flags |= PLF_FILE_FLAG_IDXDIRTY;
+    }
+
+    /* Lazy files read the section headers when they are accessed */
+    if ((fileEntry->flags & PLF_FILE_FLAG_LAZY) == 0)
+    {
+        retval = plf_int_read_entries(ctx, fileIdx, PLF_SCAN_ALL);
+        if (retval < 0)
+            return retval;
+    }
+
+    return fileIdx;
+}
+
+/*
+ * Map the opened file into memory. Afterwards the file is accessed like a
+ * RAM file (fildes == -1), so no further read calls are necessary.
+ */
+static int plf_int_map_file(s_plf_ctx* ctx, int fileIdx)
+{
+#ifndef __WIN32__
+    s_plf_file_entry* fileEntry;
+    struct stat file_stat;
+    void* map;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    if (fstat(fileEntry->fildes, &file_stat) < 0)
+        return PLF_E_IO;
+
+    /* Nothing to map, not even a header */
+    if (file_stat.st_size < sizeof(s_plf_file))
+        return PLF_E_IO;
+
+    /* Too large for the address space: keep reading the file */
+    if ((size_t) file_stat.st_size != file_stat.st_size)
+        return 0;
+
+    /* Patches go straight to the file through a shared mapping */
+    if (fileEntry->flags & PLF_FILE_FLAG_PATCH)
+        map = mmap(0, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileEntry->fildes, 0);
+    else
+        map = mmap(0, file_stat.st_size, PROT_READ, MAP_PRIVATE, fileEntry->fildes, 0);
+    if (map == MAP_FAILED)
+        return PLF_E_IO;
+
+    /* The mapping stays valid after closing the file */
+    close(fileEntry->fildes);
+    fileEntry->fildes = -1;
+
+    fileEntry->buffer = map;
+    fileEntry->buffer_size = file_stat.st_size;
+    fileEntry->flags |= PLF_FILE_FLAG_MMAP;
+#endif
+    /* No mmap on Windows: stay with the read() backend */
+    return 0;
+}
+
+#ifndef __WIN32__
+/* Number of CPUs to spread work over */
+static int plf_int_num_cpus(void)
+{
+    static int cached_num_cpus = 0;
+    int num_cpus = __atomic_load_n(&cached_num_cpus, __ATOMIC_RELAXED);
+
+    if (num_cpus == 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        num_cpus = (n > 0) ? (int) n : 1;
+        __atomic_store_n(&cached_num_cpus, num_cpus, __ATOMIC_RELAXED);
+    }
+
+    return num_cpus;
+}
+
+/* Part of a section checksummed on a thread of plf_int_calc_crc() */
+typedef struct
+{
+    s_plf_ctx*  ctx;
+    int         fileIdx;
+    int         sectIdx;
+    u32         offset;
+    u32         len;
+    u32         crc;                          // CRC accumulator of the part, started at 0
+    int         retval;
+} s_plf_crc_part;
+
+static void* plf_int_crc_thread(void* arg)
+{
+    s_plf_crc_part* part = (s_plf_crc_part*) arg;
+
+    part->retval = plf_int_calc_crc_part(part->ctx, part->fileIdx, part->sectIdx,
+            part->offset, part->len, &part->crc);
+
+    return 0;
+}
 
-    /* No free entry left */
-    if (fileIdx >= PLF_MAX_ALLOWED_FILES)
-        return PLF_E_NO_SPACE;
+/*
+ * Checksum a large section in parts on several threads and combine the
+ * accumulators of the parts. Returns 1 if the section is too small to be
+ * split (or there is only one CPU).
+ */
+static int plf_int_calc_crc_parallel(s_plf_ctx* ctx, int fileIdx, int sectIdx, u32 size, u32* crc)
+{
+    s_plf_crc_part parts[PLF_CRC_MAX_THREADS];
+    pthread_t threads[PLF_CRC_MAX_THREADS];
+    int started[PLF_CRC_MAX_THREADS];
+    int num_parts, i;
+    u32 crc_accum;
 
-    /* Init this entry */
-    fileEntry = &plf_files[fileIdx];
-    fileEntry->buffer = 0;
-    fileEntry->buffer_size = 0;
-    fileEntry->entries = 0;
-    fileEntry->fildes = -1;
-    fileEntry->num_entries = 0;
-    fileEntry->flags = 0;
-    fileEntry->current_size = 0;
+    num_parts = size / PLF_CRC_PART_SIZE;
 
-    fileEntry->hdr.dwMagic = PLF_MAGIC_CODE;
+    if (num_parts < 2)
+        return 1;
 
-    /* Found a free index */
-    return fileIdx;
-}
+    if (num_parts > plf_int_num_cpus())
+        num_parts = plf_int_num_cpus();
 
+    if (num_parts > PLF_CRC_MAX_THREADS)
+        num_parts = PLF_CRC_MAX_THREADS;
 
-static s_plf_section_entry* plf_int_get_section(int fileIdx, int sectIdx)
-{
-    int i;
-    s_plf_section_entry* curEntry;
+    if (num_parts < 2)
+        return 1;
 
-    if (fileIdx >= PLF_MAX_ALLOWED_FILES || plf_files[fileIdx].hdr.dwMagic
-            != PLF_MAGIC_CODE)
-        return 0;
+    for (i = 0; i < num_parts; ++i)
+    {
+        parts[i].ctx = ctx;
+        parts[i].fileIdx = fileIdx;
+        parts[i].sectIdx = sectIdx;
+        parts[i].offset = (u32) ((u64) size * i / num_parts);
+        parts[i].len = (u32) ((u64) size * (i + 1) / num_parts) - parts[i].offset;
+        parts[i].crc = 0;
+        parts[i].retval = 0;
+
+        /* The first part is done by this thread, as are parts whose thread couldn't be started */
+        started[i] = (i > 0) && (pthread_create(&threads[i], 0, plf_int_crc_thread, &parts[i]) == 0);
+    }
 
-    if ((u32) sectIdx >= plf_files[fileIdx].num_entries)
-        return 0;
+    for (i = 0; i < num_parts; ++i)
+    {
+        if (!started[i])
+            plf_int_crc_thread(&parts[i]);
+    }
 
-    i = 0;
-    curEntry = plf_files[fileIdx].entries;
+    for (i = 1; i < num_parts; ++i)
+    {
+        if (started[i])
+            pthread_join(threads[i], 0);
+    }
 
-    while (curEntry)
+    crc_accum = parts[0].crc;
+
+    for (i = 0; i < num_parts; ++i)
     {
-        if (i == sectIdx)
-            break;
+        if (parts[i].retval < 0)
+            return parts[i].retval;
 
-        curEntry = curEntry->next;
-        ++i;
+        if (i > 0)
+            crc_accum = crc32_calc_combine(crc_accum, parts[i].crc, parts[i].len);
     }
 
-    return curEntry;
+    crc32_calc_dw(&crc_accum, &size);
+
+    *crc = crc_accum;
+    return 0;
 }
+#endif
 
 /*
- * Read all the entries
+ * CRC32 of the content of a section, as stored in its header. With split
+ * large sections are checksummed in parts on several threads.
  */
-static int plf_int_read_entries(int fileIdx)
+static int plf_int_calc_crc(s_plf_ctx* ctx, int fileIdx, int sectIdx, int split, u32* crc)
 {
+    u32 crc_accum = 0;
+    u32 crc_num_size;
+    s_plf_section* section;
     s_plf_file_entry* fileEntry;
-    u32 current_offset;
-    int ret_val;
-
-    PLF_VERIFY_IDX(fileIdx);
-
-    fileEntry = &plf_files[fileIdx];
+    int retval;
 
-    /* Check if entries are already read */
-    if ( (fileEntry->flags & PLF_FILE_FLAG_OPENED) != 0)
-        return fileEntry->num_entries;
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
 
-    fileEntry->flags |= PLF_FILE_FLAG_OPENED;
+    section = plf_int_get_section(ctx, fileIdx, sectIdx);
 
-    /* Skip file header */
-    current_offset = sizeof(s_plf_file);
+    if (section == 0)
+        return PLF_E_PARAM;
 
-    if (fileEntry->fildes == -1)
+#ifndef __WIN32__
+    /* Files being written flush their write buffer on reads, keep them on one thread */
+    if (split && (fileEntry->flags & PLF_FILE_FLAG_WRITE) == 0)
     {
-        s_plf_section* tmpSection;
+        retval = plf_int_calc_crc_parallel(ctx, fileIdx, sectIdx, section->dwSectionSize, crc);
+        if (retval <= 0)
+            return retval;
+    }
+#endif
 
-        /* Load from RAM */
-        while (current_offset < fileEntry->buffer_size)
-        {
-            u32 section_offset_start = current_offset;
+    retval = plf_int_calc_crc_part(ctx, fileIdx, sectIdx, 0, section->dwSectionSize, &crc_accum);
+    if (retval < 0)
+        return retval;
 
-            /* Check if entry header is available */
-            if (current_offset + fileEntry->hdr.dwSectHdrSize
-                    > fileEntry->buffer_size)
-                break;
+    // finish crc
+    crc_num_size = section->dwSectionSize;
+    crc32_calc_dw(&crc_accum, &crc_num_size);
 
-            /* Read entry header */
-            tmpSection = (s_plf_section*) ((u8*) (fileEntry->buffer)
-                    + current_offset);
+    *crc = crc_accum;
+    return 0;
+}
 
-            /* Skip payload */
-            current_offset += fileEntry->hdr.dwSectHdrSize
-                    + tmpSection->dwSectionSize;
+/*
+ * CRC32 accumulator (without the final crc32_calc_dw()) of len bytes of a
+ * section from offset on
+ */
+static int plf_int_calc_crc_part(s_plf_ctx* ctx, int fileIdx, int sectIdx, u32 offset, u32 len, u32* crc)
+{
+    u32 crc_accum = *crc;
+    u32 crc_num_size = 0;
+    s_plf_file_entry* fileEntry;
 
-            /* Check if payload is completely available */
-            if (current_offset > fileEntry->buffer_size)
-                break;
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
 
-            /* Add entry */
-            ret_val = plf_int_add_entry(fileIdx, tmpSection,
-                    fileEntry->hdr.dwSectHdrSize + section_offset_start);
-            if (ret_val < 0)
-            {
-                return ret_val;
-            }
+    if (fileEntry->fildes == -1)
+    {
+        // Buffer case
 
-            /* Align */
-            int bytes_to_seek = 4 - (tmpSection->dwSectionSize & 3);
-            if (bytes_to_seek != 4)
-            {
-                current_offset += bytes_to_seek;
-            }
-        }
+        crc32_calc_buffer(&crc_accum, &crc_num_size, (((u8*) fileEntry->buffer)
+                + fileEntry->sect_offset[sectIdx] + offset), len);
     }
     else
     {
-        /* load from file */
-        struct stat file_stat;
-
-        /* get file details */
-        if (fstat(fileEntry->fildes, &file_stat) < 0)
-        {
-            return PLF_E_IO;
-        }
-
-        /* allocate memory for the read buffer */
-        s_plf_section* tmpSection = (s_plf_section*) malloc(
-                fileEntry->hdr.dwSectHdrSize);
+        // File case.. we need to read the contents of the file
+        u8* tmpBuf = (u8*) malloc(PLF_COPY_CHUNK);
 
-        if (tmpSection == 0)
+        if (tmpBuf == 0)
             return PLF_E_MEM;
 
-        /* seek to the first entry */
-        current_offset = lseek(fileEntry->fildes, fileEntry->hdr.dwHdrSize,
-                SEEK_SET);
+        u32 bytes_remaining = len;
 
-        /* read all entries */
-        while (current_offset >= 0 && current_offset < file_stat.st_size)
+        while (bytes_remaining > 0)
         {
-            int read_bytes;
-
-            u32 section_offset_start = current_offset;
-
-            /* read the header */
-            read_bytes = read(fileEntry->fildes, tmpSection,
-                    fileEntry->hdr.dwSectHdrSize);
-
-            /* check if at least the header was read */
-            if (read_bytes < fileEntry->hdr.dwSectHdrSize)
-                break;
-
-            /* skip payload of this header */
-            current_offset = lseek(fileEntry->fildes,
-                    tmpSection->dwSectionSize, SEEK_CUR);
-
-            /* check if payload is available in the file */
-            if (current_offset > file_stat.st_size)
-                break;
-
-            /* add the entry */
-            ret_val = plf_int_add_entry(fileIdx, tmpSection,
-                    fileEntry->hdr.dwSectHdrSize + section_offset_start);
-
-            if (ret_val < 0)
+            u32 read_len;
+            if (bytes_remaining > PLF_COPY_CHUNK)
             {
-                free(tmpSection);
-                return ret_val;
+                read_len = PLF_COPY_CHUNK;
+            }
+            else
+            {
+                read_len = bytes_remaining;
             }
 
-            /* Align... */
-            int bytes_to_seek = 4 - (tmpSection->dwSectionSize & 3);
-            if (bytes_to_seek != 4)
+            int bytes_read = plf_ctx_get_payload_raw(ctx, fileIdx, sectIdx, tmpBuf,
+                    offset, read_len);
+            if (bytes_read < (int) read_len)
             {
-                current_offset = lseek(fileEntry->fildes, bytes_to_seek,
-                        SEEK_CUR);
+                free(tmpBuf);
+                return (bytes_read < 0) ? bytes_read : PLF_E_IO;
             }
-        } /* while(...) */
 
-        free(tmpSection);
+            crc32_calc_buffer(&crc_accum, &crc_num_size, tmpBuf, read_len);
+
+            bytes_remaining -= read_len;
+            offset += read_len;
+
+        }
+
+        free(tmpBuf);
+
     }
 
+    *crc = crc_accum;
     return 0;
 }
 
+/*
+ * Identity of a file for the sidecar index
+ */
+static void plf_int_get_idx_key(const struct stat* file_stat, s_plf_idx_key* key)
+{
+    memset(key, 0, sizeof(s_plf_idx_key));
+
+    key->qwSize = file_stat->st_size;
+    key->qwMtime = file_stat->st_mtime;
+    key->qwCtime = file_stat->st_ctime;
+    key->qwInode = file_stat->st_ino;
+    key->qwDevice = file_stat->st_dev;
+#if defined(__APPLE__)
+    key->qwMtimeNs = file_stat->st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+    key->qwMtimeNs = file_stat->st_mtim.tv_nsec;
+#endif
+}
 
 /*
- * Open entry point of the file. This section is a s_plf_file (see plf_structs.h)
+ * Take the section table from the sidecar index. The index is mapped and
+ * only used if it belongs to this very file, which needs no reads of the
+ * file besides its header.
  */
-static int plf_int_open_file(int fileIdx)
+static int plf_int_load_index(s_plf_ctx* ctx, int fileIdx)
 {
-    int retval;
+#ifndef __WIN32__
     s_plf_file_entry* fileEntry;
-    int bytes_read;
+    const s_plf_idx_header* idxHeader;
+    const s_plf_idx_entry* idxEntry;
+    struct stat idx_stat;
+    void* map;
+    u32 i, num_entries;
+    u64 last_offset;
+    int fd;
+    int retval = PLF_E_STREAM;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    /* Nothing to take over, or the file isn't the one it was opened as */
+    if (fileEntry->num_entries != 0 || fileEntry->scan_end != fileEntry->idx_key.qwSize)
+        return PLF_E_PARAM;
+
+    fd = open(fileEntry->idx_path, O_RDONLY | F_O_BINARY);
+    if (fd < 0)
+        return PLF_E_IO;
 
-    PLF_VERIFY_IDX(fileIdx);
+    if (fstat(fd, &idx_stat) < 0 || idx_stat.st_size < sizeof(s_plf_idx_header)
+            || (size_t) idx_stat.st_size != idx_stat.st_size)
+    {
+        close(fd);
+        return PLF_E_IO;
+    }
 
-    fileEntry = &plf_files[fileIdx];
+    map = mmap(0, idx_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-    bytes_read = plf_int_read(fileIdx, (void*) (&fileEntry->hdr), 0,
-            sizeof(s_plf_file));
+    if (map == MAP_FAILED)
+        return PLF_E_IO;
 
-    if (bytes_read != sizeof(s_plf_file))
+    idxHeader = (const s_plf_idx_header*) map;
+    idxEntry = (const s_plf_idx_entry*) ((const u8*) map + sizeof(s_plf_idx_header));
+    num_entries = idxHeader->dwNumEntries;
+
+    /* Format, file identity and PLF header have to match */
+    if (idxHeader->dwMagic != PLF_IDX_MAGIC
+            || idxHeader->dwVersion != PLF_IDX_VERSION
+            || idxHeader->dwHdrSize != sizeof(s_plf_idx_header)
+            || idxHeader->dwEntrySize != sizeof(s_plf_idx_entry)
+            || (u64) idx_stat.st_size != sizeof(s_plf_idx_header) + (u64) num_entries * sizeof(s_plf_idx_entry)
+            || memcmp(&idxHeader->key, &fileEntry->idx_key, sizeof(s_plf_idx_key)) != 0
+            || memcmp(&idxHeader->hdr, &fileEntry->hdr, sizeof(s_plf_file)) != 0
+            || idxHeader->qwScanEnd < fileEntry->scan_offset
+            || idxHeader->qwScanEnd > fileEntry->scan_end)
+        goto plf_int_load_index_exit;
+
+    /* Sections have to be in order and inside the file */
+    last_offset = fileEntry->scan_offset;
+    for (i = 0; i < num_entries; ++i)
     {
-        plf_close(fileIdx);
-        return PLF_E_IO;
+        if (idxEntry[i].qwOffset < last_offset
+                || idxEntry[i].qwOffset > idxHeader->qwScanEnd
+                || idxEntry[i].sect.dwSectionSize > idxHeader->qwScanEnd - idxEntry[i].qwOffset)
+            goto plf_int_load_index_exit;
+
+        last_offset = idxEntry[i].qwOffset + idxEntry[i].sect.dwSectionSize;
     }
 
-    /* Fill unused bytes */
-    if (fileEntry->hdr.dwHdrSize < sizeof(s_plf_file))
+    if (num_entries > 0)
     {
-        u8* p_start = ((u8*) (&fileEntry->hdr)) + fileEntry->hdr.dwHdrSize;
-        u32 fill_size = sizeof(s_plf_file) - fileEntry->hdr.dwHdrSize;
-        memset(p_start, 0, fill_size);
+        fileEntry->sect_hdr = (s_plf_section*) malloc(num_entries * sizeof(s_plf_section));
+        fileEntry->sect_offset = (u64*) malloc(num_entries * sizeof(u64));
+        fileEntry->sect_state = (u8*) malloc(num_entries * sizeof(u8));
+
+        if (fileEntry->sect_hdr == 0 || fileEntry->sect_offset == 0 || fileEntry->sect_state == 0)
+        {
+            free(fileEntry->sect_hdr);
+            free(fileEntry->sect_offset);
+            free(fileEntry->sect_state);
+            fileEntry->sect_hdr = 0;
+            fileEntry->sect_offset = 0;
+            fileEntry->sect_state = 0;
+            retval = PLF_E_MEM;
+            goto plf_int_load_index_exit;
+        }
+
+        fileEntry->max_entries = num_entries;
     }
 
-    retval = plf_int_read_entries(fileIdx);
-    if (retval < 0)
-        return retval;
+    for (i = 0; i < num_entries; ++i)
+    {
+        fileEntry->sect_hdr[i] = idxEntry[i].sect;
+        fileEntry->sect_offset[i] = idxEntry[i].qwOffset;
+        fileEntry->sect_state[i] = (idxEntry[i].dwCrcState <= PLF_SECT_CRC_BAD) ? idxEntry[i].dwCrcState : PLF_SECT_CRC_UNKNOWN;
+    }
 
-    return fileIdx;
+    fileEntry->num_entries = num_entries;
+    fileEntry->scan_offset = idxHeader->qwScanEnd;
+    fileEntry->flags |= PLF_FILE_FLAG_OPENED;
+    retval = 0;
+
+plf_int_load_index_exit:
+    munmap(map, idx_stat.st_size);
+    return retval;
+#else
+    /* No mmap on Windows: scan the file */
+    return PLF_E_NOT_IMPLEMENTED;
+#endif
 }
 
 /*
  * Read one section
  */
-static int plf_int_read(int fileIdx, void* dst, u32 offset, u32 len)
+static s64 plf_int_read(s_plf_ctx* ctx, int fileIdx, void* dst, u64 offset, u64 len)
 {
     s_plf_file_entry* fileEntry;
-    int bytes_read;
+    s64 bytes_read;
 
-    PLF_VERIFY_IDX(fileIdx);
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
 
     if (dst == 0)
         return PLF_E_PARAM;
 
-    fileEntry = &plf_files[fileIdx];
 
     // From memory?
     if (fileEntry->fildes == -1)
@@ -844,8 +2984,38 @@ static int plf_int_read(int fileIdx, void* dst, u32 offset, u32 len)
     }
     else
     {
-        lseek(fileEntry->fildes, offset, SEEK_SET);
-        bytes_read = read(fileEntry->fildes, dst, len);
+        /* The file has to be up to date */
+        if (fileEntry->wbuf_len > 0 && plf_int_flush(ctx, fileIdx) < 0)
+            return PLF_E_IO;
+
+        if (fileEntry->flags & PLF_FILE_FLAG_WINDOW)
+        {
+            /* Don't read beyond the section */
+            if (offset >= fileEntry->window_size)
+                return 0;
+
+            if (len > fileEntry->window_size - offset)
+                len = fileEntry->window_size - offset;
+        }
+
+        bytes_read = 0;
+
+        /* Large reads in chunks, until done or the end of the file */
+        while (len > 0)
+        {
+            u32 read_len = (len > PLF_IO_CHUNK) ? PLF_IO_CHUNK : (u32) len;
+            int ret_val = plf_pread(fileEntry->fildes, (u8*) dst + bytes_read, read_len,
+                    fileEntry->window_offset + offset + bytes_read);
+
+            if (ret_val < 0)
+                return (bytes_read > 0) ? bytes_read : ret_val;
+
+            if (ret_val == 0)
+                break;
+
+            bytes_read += ret_val;
+            len -= ret_val;
+        }
     }
 
     return bytes_read;
@@ -854,20 +3024,39 @@ static int plf_int_read(int fileIdx, void* dst, u32 offset, u32 len)
 /*
  * Write (to file or in memory)
  */
-static int plf_int_write(int fileIdx, const void* src, u32 offset, u32 len)
+static int plf_int_write(s_plf_ctx* ctx, int fileIdx, const void* src, u64 offset, u32 len)
 {
     s_plf_file_entry* fileEntry;
     int bytes_written;
 
-    PLF_VERIFY_IDX(fileIdx);
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
 
     if (src == 0)
         return PLF_E_PARAM;
 
-    fileEntry = &plf_files[fileIdx];
 
     if (fileEntry->fildes == -1)
     {
+        /* Own buffer (plf_create_ram): make room */
+        if ((fileEntry->flags & PLF_FILE_FLAG_OWNBUF) && offset + len > fileEntry->buffer_size)
+        {
+            u64 new_size = fileEntry->buffer_size * 2;
+            void* new_buffer;
+
+            if (new_size < offset + len)
+                new_size = offset + len;
+
+            if ((size_t) new_size != new_size)
+                return PLF_E_MEM;
+
+            new_buffer = realloc((void*) fileEntry->buffer, new_size);
+            if (new_buffer == 0)
+                return PLF_E_MEM;
+
+            fileEntry->buffer = new_buffer;
+            fileEntry->buffer_size = new_size;
+        }
+
         if (offset >= fileEntry->buffer_size)
             return PLF_E_PARAM;
 
@@ -882,64 +3071,235 @@ static int plf_int_write(int fileIdx, const void* src, u32 offset, u32 len)
 
         memcpy((u8*) fileEntry->buffer + offset, src,  bytes_written);
     }
+    else if (fileEntry->wbuf_size > 0)
+    {
+        u64 wbuf_end = fileEntry->wbuf_offset + fileEntry->wbuf_len;
+
+        if (fileEntry->wbuf == 0)
+        {
+            fileEntry->wbuf = (u8*) malloc(fileEntry->wbuf_size);
+            if (fileEntry->wbuf == 0)
+                return PLF_E_MEM;
+        }
+
+        /* Inside the buffered data, e.g. a section header being renewed */
+        if (fileEntry->wbuf_len > 0 && offset >= fileEntry->wbuf_offset && offset + len <= wbuf_end)
+        {
+            memcpy(fileEntry->wbuf + (offset - fileEntry->wbuf_offset), src, len);
+            return len;
+        }
+
+        /* Continues the buffered data */
+        if (fileEntry->wbuf_len > 0 && offset == wbuf_end && len <= fileEntry->wbuf_size - fileEntry->wbuf_len)
+        {
+            memcpy(fileEntry->wbuf + fileEntry->wbuf_len, src, len);
+            fileEntry->wbuf_len += len;
+            return len;
+        }
+
+        /* Somewhere else, e.g. the header of a large section: one positional write */
+        if (fileEntry->wbuf_len > 0 && (offset + len <= fileEntry->wbuf_offset || offset > wbuf_end))
+            return plf_pwrite(fileEntry->fildes, src, len, offset);
+
+        /* Overlaps or doesn't fit: write out the buffer first */
+        if (fileEntry->wbuf_len > 0 && plf_int_flush(ctx, fileIdx) < 0)
+            return PLF_E_IO;
+
+        if (len < fileEntry->wbuf_size)
+        {
+            memcpy(fileEntry->wbuf, src, len);
+            fileEntry->wbuf_offset = offset;
+            fileEntry->wbuf_len = len;
+            return len;
+        }
+
+        /* Too large to be buffered */
+        bytes_written = plf_pwrite(fileEntry->fildes, src, len, offset);
+    }
     else
     {
-        lseek(fileEntry->fildes, offset, SEEK_SET);
-        bytes_written = write(fileEntry->fildes, src, len);
+        bytes_written = plf_pwrite(fileEntry->fildes, src, len, offset);
     }
 
     return bytes_written;
 }
 
+/*
+ * Write all of iov, in as few calls as possible. iov is modified.
+ */
+static int plf_int_writev(int fd, struct iovec* iov, int iovcnt, u64 offset)
+{
+    while (iovcnt > 0)
+    {
+        s64 bytes_written;
+
+        /* Nothing (left) to write in this one */
+        if (iov->iov_len == 0)
+        {
+            ++iov;
+            --iovcnt;
+            continue;
+        }
+
+        bytes_written = plf_pwritev(fd, iov, (iovcnt > PLF_IOV_MAX) ? PLF_IOV_MAX : iovcnt, offset);
+        if (bytes_written <= 0)
+            return PLF_E_IO;
+
+        offset += bytes_written;
+
+        /* Skip what is written, continue after a partial write */
+        while (bytes_written > 0)
+        {
+            if ((u64) bytes_written >= iov->iov_len)
+            {
+                bytes_written -= iov->iov_len;
+                ++iov;
+                --iovcnt;
+            }
+            else
+            {
+                iov->iov_base = (u8*) iov->iov_base + bytes_written;
+                iov->iov_len -= bytes_written;
+                bytes_written = 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Copy between two files without passing the data through user space:
+ * copy_file_range(), or sendfile() if the files don't allow that. off_out < 0
+ * writes at the current position of fd_out. Returns the number of bytes
+ * copied, the caller copies the rest if the kernel can't (e.g. no Linux).
+ */
+static s64 plf_int_copy_fd(int fd_in, u64 off_in, int fd_out, s64 off_out, u64 len)
+{
+    s64 bytes_copied = 0;
+#ifdef __linux__
+    int use_sendfile = 0;
+
+    while ((u64) bytes_copied < len)
+    {
+        size_t copy_len = (len - bytes_copied > PLF_IO_CHUNK) ? PLF_IO_CHUNK : (size_t) (len - bytes_copied);
+        s64 ret_val = -1;
+
+# ifdef SYS_copy_file_range
+        if (!use_sendfile)
+        {
+            s64 pos_in = off_in + bytes_copied;
+            s64 pos_out = off_out + bytes_copied;
+
+            ret_val = syscall(SYS_copy_file_range, fd_in, &pos_in, fd_out,
+                    (off_out < 0) ? 0 : &pos_out, copy_len, 0);
+
+            /* Not supported for these files: try sendfile */
+            if (ret_val < 0)
+                use_sendfile = (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+                        || errno == EOPNOTSUPP || errno == EBADF);
+        }
+# else
+        use_sendfile = 1;
+# endif
+
+        if (use_sendfile)
+        {
+            off_t pos_in = off_in + bytes_copied;
+
+            /* sendfile writes at the file position */
+            if (off_out >= 0 && lseek(fd_out, off_out + bytes_copied, SEEK_SET) < 0)
+                break;
+
+            ret_val = sendfile(fd_out, fd_in, &pos_in, copy_len);
+        }
+
+        if (ret_val <= 0)
+            break;
+
+        bytes_copied += ret_val;
+    }
+#endif
+    return bytes_copied;
+}
+
+/*
+ * Write the contents of the write buffer to the file
+ */
+static int plf_int_flush(s_plf_ctx* ctx, int fileIdx)
+{
+    s_plf_file_entry* fileEntry;
+    u32 bytes_done = 0;
+
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
+
+    while (bytes_done < fileEntry->wbuf_len)
+    {
+        int bytes_written = plf_pwrite(fileEntry->fildes, fileEntry->wbuf + bytes_done,
+                fileEntry->wbuf_len - bytes_done, fileEntry->wbuf_offset + bytes_done);
+
+        if (bytes_written <= 0)
+            return PLF_E_IO;
+
+        bytes_done += bytes_written;
+    }
+
+    fileEntry->wbuf_len = 0;
+
+    return 0;
+}
+
 
 /*
- * Add a section at the end of the chained list
+ * Add a section at the end of the section table
  */
-static int plf_int_add_entry(int fileIdx, const s_plf_section* section, u32 offset)
+static int plf_int_add_entry(s_plf_ctx* ctx, int fileIdx, const s_plf_section* section, u64 offset)
 {
     int entryIdx;
     s_plf_file_entry* fileEntry;
-    s_plf_section_entry* sectionEntry;
-    PLF_VERIFY_IDX(fileIdx);
+    PLF_GET_FILE_ENTRY(fileEntry, fileIdx);
 
     if (section == 0)
         return PLF_E_PARAM;
 
-    fileEntry = &plf_files[fileIdx];
+    /* Grow the table (doubles, so appending is amortised O(1)) */
+    if (fileEntry->num_entries >= fileEntry->max_entries)
+    {
+        u32 new_max = fileEntry->max_entries * 2;
+        s_plf_section* new_hdr;
+        u64* new_offset;
+        u8* new_state;
 
-    sectionEntry = (s_plf_section_entry*) malloc(sizeof(s_plf_section_entry));
-    if (sectionEntry == 0)
-        return PLF_E_MEM;
+        if (new_max < PLF_MIN_SECTION_SLOTS)
+            new_max = PLF_MIN_SECTION_SLOTS;
+
+        new_hdr = (s_plf_section*) realloc(fileEntry->sect_hdr, new_max * sizeof(s_plf_section));
+        if (new_hdr == 0)
+            return PLF_E_MEM;
+        fileEntry->sect_hdr = new_hdr;
 
-    sectionEntry->hdr.dwSectionType = section->dwSectionType;
-    sectionEntry->hdr.dwSectionSize = section->dwSectionSize;
-    sectionEntry->hdr.dwCRC32 = section->dwCRC32;
-    sectionEntry->hdr.dwLoadAddr = section->dwLoadAddr;
-    sectionEntry->hdr.dwUncomprSize = section->dwUncomprSize;
+        new_offset = (u64*) realloc(fileEntry->sect_offset, new_max * sizeof(u64));
+        if (new_offset == 0)
+            return PLF_E_MEM;
+        fileEntry->sect_offset = new_offset;
 
-    sectionEntry->next = 0;
-    sectionEntry->offset = offset;
+        new_state = (u8*) realloc(fileEntry->sect_state, new_max * sizeof(u8));
+        if (new_state == 0)
+            return PLF_E_MEM;
+        fileEntry->sect_state = new_state;
 
-    entryIdx = 0;
-    /* Add to entries list */
-    if (fileEntry->entries == 0)
-    {
-        fileEntry->entries = sectionEntry;
+        fileEntry->max_entries = new_max;
     }
-    else
-    {
-        s_plf_section_entry* curEntry = fileEntry->entries;
 
-        entryIdx = 1;
+    entryIdx = fileEntry->num_entries;
 
-        // Find end of the list
-        while (curEntry->next != 0)
-        {
-            curEntry = curEntry->next;
-            ++entryIdx;
-        }
-        curEntry->next = sectionEntry;
-    }
+    fileEntry->sect_hdr[entryIdx].dwSectionType = section->dwSectionType;
+    fileEntry->sect_hdr[entryIdx].dwSectionSize = section->dwSectionSize;
+    fileEntry->sect_hdr[entryIdx].dwCRC32 = section->dwCRC32;
+    fileEntry->sect_hdr[entryIdx].dwLoadAddr = section->dwLoadAddr;
+    fileEntry->sect_hdr[entryIdx].dwUncomprSize = section->dwUncomprSize;
+    fileEntry->sect_offset[entryIdx] = offset;
+    fileEntry->sect_state[entryIdx] = PLF_SECT_CRC_UNKNOWN;
 
     ++fileEntry->num_entries;
 
@@ -26,6 +26,10 @@
 #ifndef PLF_H_
 #define PLF_H_
 
+#include <stddef.h>
+#ifndef __WIN32__
+# include <sys/uio.h>
+#endif
 #include "types.h"
 #include "plf_structs.h"
 #include "crc32.h"
@@ -47,29 +51,234 @@ typedef struct s_plf_version_info_tag
 } s_plf_version_info;
 
 
+/*
+ * Library context. Each context has its own table of files and no state is
+ * shared between contexts, so different threads can work in parallel as long
+ * as each uses its own context. A file handle is only valid in the context
+ * it was opened in.
+ * The plf_xxx functions without context work on a default context. Its
+ * file table is not locked: functions that open, create or close files
+ * must not run concurrently on it. Reads on handles that are already open
+ * are safe from several threads (see plf_get_num_sections).
+ */
+typedef struct s_plf_ctx_tag s_plf_ctx;
+
+
+#ifdef __WIN32__
+/* As in <sys/uio.h>, for plf_write_section() */
+struct iovec
+{
+    void*  iov_base;
+    size_t iov_len;
+};
+#endif
+
+
+/* Flags for plf_write_section_ex(), plf_copy_section_ex() and plf_extract_section_to_fd_ex() */
+#define PLF_WRITE_KEEP_CRC  0x00000001u  /* Take dwCRC32 of the given (source) header instead of computing it */
+#define PLF_WRITE_VERIFY_CRC 0x00000002u /* Check the data against dwCRC32 of the (source) header while writing it */
+
+
+/* Flags for plf_open_file_ex() */
+#define PLF_OPEN_MMAP       0x00000001u  /* Map the file into memory instead of reading it on every access */
+#define PLF_OPEN_LAZY       0x00000002u  /* Read section headers when they are accessed, not all at open */
+#define PLF_OPEN_INDEX      0x00000004u  /* Use and update the sidecar index <filename>.plfidx (or in plf_set_index_dir()), see plf_write_index() */
+#define PLF_OPEN_PATCH      0x00000008u  /* Open for writing too, for plf_patch_payload() */
+
+
 int plf_create_file(const char* filename);
-int plf_create_ram(const void* buffer, u32 buffer_size);
+/*
+ * New file in memory. With buffer == 0 libplf allocates the buffer and grows
+ * it while writing; plf_detach_ram() finishes the file and hands it over.
+ */
+int plf_create_ram(void* buffer, u32 buffer_size);
+int plf_detach_ram(int fileIdx, void** buffer, u64* buffer_size);
 int plf_open_file(const char* filename);
+int plf_open_file_ex(const char* filename, u32 flags);
+/*
+ * Keep the index of files opened with PLF_OPEN_INDEX in dir instead of next
+ * to the file, named after the device and inode of the file. Verified
+ * sections are remembered there across runs, also for files on read-only
+ * media. 0 switches back to <filename>.plfidx.
+ */
+int plf_set_index_dir(const char* dir);
 int plf_open_ram(const void* buffer, u32 buffer_size);
+/*
+ * Open the PLF file stored in an (uncompressed) section of an opened file.
+ * Nothing is copied, the section file reads from its parent, so the parent
+ * must stay open until the section file is closed.
+ */
+int plf_open_section(int parentIdx, int sectIdx);
 
+/*
+ * Files are read with positional I/O (pread), so the read functions below
+ * (plf_check_crc, plf_verify, plf_get_payload_xxx) can be called concurrently
+ * on the same handle from several threads, as long as the handle is neither
+ * written nor closed meanwhile. Not on Windows, pread is emulated there.
+ * With PLF_OPEN_LAZY, call plf_get_num_sections() first: it reads all
+ * section headers, accessing a section only reads up to that section.
+ * plf_check_crc() remembers its result in the handle, concurrent checks of
+ * a section store the same result. Sections of 16 MiB and more are
+ * checksummed in parts on several threads (one per CPU, at most 16).
+ */
 int plf_get_num_sections(int fileIdx);
 int plf_check_crc(int fileIdx, int entryIdx);
 int plf_verify(int fileIdx);
+/*
+ * Verify all sections on nthreads threads (0: one per CPU) and store the
+ * result of plf_check_crc() for every section in results (may be 0,
+ * otherwise one entry per section). Unlike plf_verify() it doesn't stop at
+ * the first bad section. Returns the result of the first bad section, or 0.
+ */
+int plf_verify_parallel(int fileIdx, int nthreads, int* results);
 
 int plf_begin_section(int fileIdx);
+/*
+ * With compress != 0 (gzip level 1-9, higher values: default level) the
+ * payload is compressed while it is written, in the format read by
+ * plf_get_payload_uncompressed(). dwUncomprSize counts the data passed in,
+ * plf_finish_section() ends the stream, the CRC32 covers the compressed
+ * data. All chunks of a section have to use the same compress setting.
+ * Sections of more than 128 KiB are compressed in blocks on several
+ * threads (one per CPU, at most 64), joined to a single gzip stream.
+ */
 int plf_write_payload(int fileIdx, int sectIndx, const void* buffer, u32 len, u8 compress);
 int plf_finish_section(int fileIdx, int sectIdx);
+/*
+ * Add a complete section in one go: the payload is taken from iov, size and
+ * CRC32 are computed, type, load address and dwUncomprSize come from hdr.
+ * Header, payload and padding are written with a single pwritev().
+ * With PLF_WRITE_KEEP_CRC the CRC32 is taken from hdr, for a payload copied
+ * unchanged from a verified section.
+ * With PLF_WRITE_VERIFY_CRC the computed CRC32 must match the one in hdr,
+ * otherwise nothing is written and PLF_E_CRC is returned: a section is
+ * copied and checked in one pass. It takes precedence over
+ * PLF_WRITE_KEEP_CRC, as in plf_copy_section_ex(): with both the CRC32 is
+ * still computed and compared.
+ * Returns the index of the new section.
+ */
+int plf_write_section(int fileIdx, const s_plf_section* hdr, const struct iovec* iov, int iovcnt);
+int plf_write_section_ex(int fileIdx, const s_plf_section* hdr, const struct iovec* iov, int iovcnt, u32 flags);
+/*
+ * Writes to a file are collected in a buffer (1 MiB by default) and written
+ * in large blocks, at the latest by plf_close(). A size of 0 writes directly.
+ */
+int plf_set_write_buffer(int fileIdx, u32 size);
+
+/*
+ * Copy a section as a new section of a file being written, or write its raw
+ * content to fd (at the current position of fd). Between files the data is
+ * copied by the kernel (copy_file_range, sendfile) where possible, so it
+ * doesn't pass through the application.
+ * The CRC of the copy is computed from the data, unless the source section
+ * already passed plf_check_crc()/plf_verify() (or is known to be good from
+ * the index), or PLF_WRITE_KEEP_CRC is given. With PLF_WRITE_VERIFY_CRC the
+ * source section is checked first and nothing is copied if it is bad.
+ */
+int plf_copy_section(int srcIdx, int sectIdx, int dstIdx);
+int plf_copy_section_ex(int srcIdx, int sectIdx, int dstIdx, u32 flags);
+s64 plf_extract_section_to_fd(int fileIdx, int sectIdx, int fd);
+/*
+ * With PLF_WRITE_VERIFY_CRC the CRC is computed while the section is written
+ * to fd, so it is read only once. On a mismatch PLF_E_CRC is returned and fd
+ * is truncated back to its position before the call (not possible for
+ * pipes). The result is remembered as by plf_check_crc().
+ */
+s64 plf_extract_section_to_fd_ex(int fileIdx, int sectIdx, int fd, u32 flags);
+
+/*
+ * Overwrite len bytes of a section in place, in a file opened with
+ * PLF_OPEN_PATCH (or being written). dwCRC32 is updated from the changed
+ * bytes, so the cost doesn't depend on the size of the section. A section
+ * that was damaged before stays damaged.
+ */
+int plf_patch_payload(int fileIdx, int sectIdx, u32 offset, const void* data, u32 len);
 
 int plf_get_payload_raw(int fileIdx, int sectIdx, void* dst_buffer, u32 offset, u32 len);
 int plf_get_payload_uncompressed(int fileIdx, int sectIdx, void** buffer, u32* buffer_size);
+/*
+ * Read-only view of the raw section data. Points directly into the file for
+ * RAM and mapped (PLF_OPEN_MMAP) files, otherwise into a temporary copy.
+ * Release every view with plf_release_payload_view() before closing the file.
+ */
+int plf_get_payload_view(int fileIdx, int sectIdx, const void** payload, u32* len);
+int plf_release_payload_view(int fileIdx, const void* payload);
+/* The returned section header is only valid until the next section is added to the file (plf_begin_section, or found with PLF_OPEN_LAZY) */
 s_plf_section* plf_get_section_header(int fileIdx, int sectIdx);
 s_plf_file* plf_get_file_header(int fileIdx);
 
 int plf_close(int fileIdx);
 
+/*
+ * Sidecar index of a file opened with PLF_OPEN_INDEX. It holds the section
+ * table and the results of plf_check_crc()/plf_verify(), and is only used
+ * if size, modification time and inode of the file are unchanged. Then
+ * opening the file reads no section headers and sections already checked
+ * are not checked again. plf_close() writes the index if it was missing or
+ * outdated or new CRC results are known (not for lazy files that were not
+ * read completely); plf_write_index() writes it right away.
+ */
+int plf_write_index(int fileIdx);
+
+/*
+ * Files and buffers are addressed with 64 bit offsets, so sections may be
+ * located beyond 4 GiB (e.g. in a large container). The PLF headers stay
+ * 32 bit, sizes or offsets which may not fit are available here.
+ */
+int plf_open_ram_64(const void* buffer, u64 buffer_size);
+s64 plf_get_payload_raw_64(int fileIdx, int sectIdx, void* dst_buffer, u64 offset, u64 len);
+s64 plf_get_section_offset_64(int fileIdx, int sectIdx);
+s64 plf_get_file_size_64(int fileIdx);
+
 const s_plf_version_info* plf_lib_get_version(void);
 
 
+s_plf_ctx* plf_ctx_create(void);
+int plf_ctx_destroy(s_plf_ctx* ctx);
+
+int plf_ctx_create_file(s_plf_ctx* ctx, const char* filename);
+int plf_ctx_create_ram(s_plf_ctx* ctx, void* buffer, u32 buffer_size);
+int plf_ctx_detach_ram(s_plf_ctx* ctx, int fileIdx, void** buffer, u64* buffer_size);
+int plf_ctx_open_file(s_plf_ctx* ctx, const char* filename);
+int plf_ctx_open_file_ex(s_plf_ctx* ctx, const char* filename, u32 flags);
+int plf_ctx_set_index_dir(s_plf_ctx* ctx, const char* dir);
+int plf_ctx_open_ram(s_plf_ctx* ctx, const void* buffer, u32 buffer_size);
+int plf_ctx_open_section(s_plf_ctx* ctx, int parentIdx, int sectIdx);
+
+int plf_ctx_get_num_sections(s_plf_ctx* ctx, int fileIdx);
+int plf_ctx_check_crc(s_plf_ctx* ctx, int fileIdx, int entryIdx);
+int plf_ctx_verify(s_plf_ctx* ctx, int fileIdx);
+int plf_ctx_verify_parallel(s_plf_ctx* ctx, int fileIdx, int nthreads, int* results);
+
+int plf_ctx_begin_section(s_plf_ctx* ctx, int fileIdx);
+int plf_ctx_write_payload(s_plf_ctx* ctx, int fileIdx, int sectIndx, const void* buffer, u32 len, u8 compress);
+int plf_ctx_finish_section(s_plf_ctx* ctx, int fileIdx, int sectIdx);
+int plf_ctx_write_section(s_plf_ctx* ctx, int fileIdx, const s_plf_section* hdr, const struct iovec* iov, int iovcnt);
+int plf_ctx_write_section_ex(s_plf_ctx* ctx, int fileIdx, const s_plf_section* hdr, const struct iovec* iov, int iovcnt,
+        u32 flags);
+int plf_ctx_set_write_buffer(s_plf_ctx* ctx, int fileIdx, u32 size);
+int plf_ctx_copy_section(s_plf_ctx* ctx, int srcIdx, int sectIdx, int dstIdx);
+int plf_ctx_copy_section_ex(s_plf_ctx* ctx, int srcIdx, int sectIdx, int dstIdx, u32 flags);
+s64 plf_ctx_extract_section_to_fd(s_plf_ctx* ctx, int fileIdx, int sectIdx, int fd);
+s64 plf_ctx_extract_section_to_fd_ex(s_plf_ctx* ctx, int fileIdx, int sectIdx, int fd, u32 flags);
+int plf_ctx_patch_payload(s_plf_ctx* ctx, int fileIdx, int sectIdx, u32 offset, const void* data, u32 len);
+
+int plf_ctx_get_payload_raw(s_plf_ctx* ctx, int fileIdx, int sectIdx, void* dst_buffer, u32 offset, u32 len);
+int plf_ctx_get_payload_uncompressed(s_plf_ctx* ctx, int fileIdx, int sectIdx, void** buffer, u32* buffer_size);
+int plf_ctx_get_payload_view(s_plf_ctx* ctx, int fileIdx, int sectIdx, const void** payload, u32* len);
+int plf_ctx_release_payload_view(s_plf_ctx* ctx, int fileIdx, const void* payload);
+s_plf_section* plf_ctx_get_section_header(s_plf_ctx* ctx, int fileIdx, int sectIdx);
+s_plf_file* plf_ctx_get_file_header(s_plf_ctx* ctx, int fileIdx);
+
+int plf_ctx_close(s_plf_ctx* ctx, int fileIdx);
+int plf_ctx_write_index(s_plf_ctx* ctx, int fileIdx);
+
+int plf_ctx_open_ram_64(s_plf_ctx* ctx, const void* buffer, u64 buffer_size);
+s64 plf_ctx_get_payload_raw_64(s_plf_ctx* ctx, int fileIdx, int sectIdx, void* dst_buffer, u64 offset, u64 len);
+s64 plf_ctx_get_section_offset_64(s_plf_ctx* ctx, int fileIdx, int sectIdx);
+s64 plf_ctx_get_file_size_64(s_plf_ctx* ctx, int fileIdx);
+
+
 #define PLF_E_NO_SPACE      -1
 #define PLF_E_PARAM         -2
 #define PLF_E_IO            -3
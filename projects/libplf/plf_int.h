@@ -31,21 +31,83 @@
 #include "plf_structs.h"
 #include "plf.h"
 
-#define PLF_MAX_ALLOWED_FILES 8
+/*
+ * A file handle consists of the slot in the file pool and the generation
+ * of the slot. The generation changes on every close, so stale handles
+ * are detected.
+ */
+#define PLF_HANDLE_SLOT_BITS  20
+#define PLF_HANDLE_MAX_SLOTS  (1u << PLF_HANDLE_SLOT_BITS)
+#define PLF_HANDLE_GEN_MASK   0x7FFu
+#define PLF_HANDLE(slot, gen) ((int) (((u32) (gen) << PLF_HANDLE_SLOT_BITS) | (u32) (slot)))
+#define PLF_HANDLE_SLOT(idx)  ((u32) (idx) & (PLF_HANDLE_MAX_SLOTS - 1))
+#define PLF_HANDLE_GEN(idx)   (((u32) (idx) >> PLF_HANDLE_SLOT_BITS) & PLF_HANDLE_GEN_MASK)
+
+#define PLF_MIN_FILE_SLOTS    8
+
+#define PLF_GET_FILE_ENTRY(entry, idx) if (((entry) = plf_int_get_file(ctx, (idx))) == 0) return PLF_E_FILE_IDX;
+
+
 
-#define PLF_VERIFY_IDX(idx) if (idx >= PLF_MAX_ALLOWED_FILES || plf_files[idx].hdr.dwMagic != PLF_MAGIC_CODE) return PLF_E_FILE_IDX;
+#define PLF_MIN_SECTION_SLOTS 16
+#define PLF_SCAN_ALL          0xFFFFFFFFu
+#define PLF_SCAN_WINDOW       0x10000u   /* Readahead for section headers */
+#define PLF_SCAN_ALIGN        0x1000u
+#define PLF_WRITE_BUFFER_SIZE 0x100000u  /* Default write buffer of new files, see plf_set_write_buffer() */
+#define PLF_COPY_CHUNK        0x100000u  /* Buffer for copies the kernel can't do and for reading sections */
+#define PLF_MIN_RAM_SIZE      0x10000u   /* Initial buffer of plf_create_ram() */
+#define PLF_IO_CHUNK          0x40000000u /* Largest single read, read() may return less above 2 GiB */
+#define PLF_CRC_PART_SIZE     0x800000u  /* Smallest part of a section checksummed on its own thread */
+#define PLF_CRC_MAX_THREADS   16
+#define PLF_GZ_MAX_THREADS    64         /* Threads compressing a section (See plf_write_payload) */
 
+/* CRC state of a section (See sect_state) */
+#define PLF_SECT_CRC_UNKNOWN  0u
+#define PLF_SECT_CRC_OK       1u
+#define PLF_SECT_CRC_BAD      2u
 
 
 /*
- * Object of the chained list
+ * Sidecar index <file>.plfidx (See PLF_OPEN_INDEX). A s_plf_idx_header
+ * followed by dwNumEntries s_plf_idx_entry, in host byte order. All fields
+ * are naturally aligned, so the file can be used directly when mapped.
  */
-typedef struct s_plf_section_entry_tag
+#define PLF_IDX_MAGIC         0x58444950  /* "PIDX" */
+#define PLF_IDX_VERSION       1u
+#define PLF_IDX_SUFFIX        ".plfidx"
+#define PLF_IDX_HASH_NONE     0u          /* No strong hashes follow the entries */
+
+/* Identity of the indexed file, the index is only used if all fields match */
+typedef struct s_plf_idx_key_tag /* Size: 0x30 Byte */
+{
+    u64 qwSize;         /* +0x00 File size */
+    u64 qwMtime;        /* +0x08 Modification time (seconds) */
+    u64 qwMtimeNs;      /* +0x10 Modification time (nanoseconds, 0 if unknown) */
+    u64 qwCtime;        /* +0x18 Status change time (seconds) */
+    u64 qwInode;        /* +0x20 Inode number */
+    u64 qwDevice;       /* +0x28 Device */
+} s_plf_idx_key;
+
+typedef struct s_plf_idx_header_tag /* Size: 0x88 Byte */
+{
+    u32 dwMagic;        /* +0x00 PLF_IDX_MAGIC, also detects a foreign byte order */
+    u32 dwVersion;      /* +0x04 PLF_IDX_VERSION */
+    u32 dwHdrSize;      /* +0x08 sizeof(s_plf_idx_header) */
+    u32 dwEntrySize;    /* +0x0C sizeof(s_plf_idx_entry) */
+    s_plf_idx_key key;  /* +0x10 Indexed file */
+    u32 dwNumEntries;   /* +0x40 Number of sections */
+    u32 dwHashType;     /* +0x44 PLF_IDX_HASH_xxx */
+    u64 qwScanEnd;      /* +0x48 End of the last section */
+    s_plf_file hdr;     /* +0x50 PLF header of the indexed file */
+} s_plf_idx_header;
+
+typedef struct s_plf_idx_entry_tag /* Size: 0x20 Byte */
 {
-    s_plf_section                   hdr;    // Section header (See in plf_structs.h)
-    u32                             offset; // Absolute starting point of the content of the section (size: hdr.dwSectionSize)
-    struct s_plf_section_entry_tag* next;  // Pointer to the next section
-} s_plf_section_entry;
+    s_plf_section sect; /* +0x00 Section header */
+    u32 dwCrcState;     /* +0x14 PLF_SECT_CRC_xxx */
+    u64 qwOffset;       /* +0x18 Start of the content */
+} s_plf_idx_entry;
+
 
 
 /*
@@ -55,18 +117,65 @@ typedef struct s_plf_file_entry_tag
 {
     s_plf_file              hdr;          // PLF header (See in plf_structs.h)
     int                     fildes;       // File handle
-    const void*             buffer;       // PLF in memory
-    u32                     buffer_size;  // Size of the PLF in memory
+    const void*             buffer;       // PLF in memory (or mapped file, see PLF_FILE_FLAG_MMAP, or allocated, see PLF_FILE_FLAG_OWNBUF)
+    u64                     buffer_size;  // Size of the PLF in memory (space for files being written)
     u32                     num_entries;  // Number of section
-    s_plf_section_entry*    entries;      // Entry point of the chained list of sections (first section
+    u32                     max_entries;  // Allocated slots of the section table
+    s_plf_section*          sect_hdr;     // Section table: headers (See in plf_structs.h), indexed by section
+    u64*                    sect_offset;  // Section table: absolute starting point of the content (size: dwSectionSize)
     u32                     flags;        // Access rights to on the file/sections
-    u32                     current_size; // Sixe of the file on the disk
+    u64                     current_size; // Sixe of the file on the disk
 #define PLF_FILE_FLAG_READ     0x00000001u
 #define PLF_FILE_FLAG_WRITE    0x00000002u
 #define PLF_FILE_FLAG_OPENED   0x00000004u
 #define PLF_FILE_FLAG_SECTOPEN 0x00000008u
+#define PLF_FILE_FLAG_MMAP     0x00000010u
+#define PLF_FILE_FLAG_INUSE    0x00000020u
+#define PLF_FILE_FLAG_WINDOW   0x00000040u
+#define PLF_FILE_FLAG_LAZY     0x00000080u
+#define PLF_FILE_FLAG_INDEX    0x00000100u
+#define PLF_FILE_FLAG_IDXDIRTY 0x00000200u
+#define PLF_FILE_FLAG_OWNBUF   0x00000400u
+#define PLF_FILE_FLAG_PATCH    0x00000800u
+    u32                     generation;   // Generation of the handle (See PLF_HANDLE)
+    int                     next_free;    // Next slot in the free list of the pool
+    u64                     window_offset;// Start of a section file in the file handle of its parent (See plf_open_section)
+    u64                     window_size;  // Size of this section file
+    u64                     scan_offset;  // Next section header to read (See PLF_FILE_FLAG_OPENED)
+    u64                     scan_end;     // End of the sections
+    u8*                     sect_state;   // Section table: CRC state (See PLF_SECT_CRC_xxx)
+    char*                   idx_path;     // Sidecar index (See PLF_FILE_FLAG_INDEX)
+    s_plf_idx_key           idx_key;      // Identity of the file when it was opened
+    u8*                     wbuf;         // Write buffer, allocated on the first write
+    u32                     wbuf_size;    // Size of the write buffer, 0 to write directly
+    u32                     wbuf_len;     // Bytes in the write buffer, not yet written
+    u64                     wbuf_offset;  // Position of the write buffer in the file
+    void*                   gz_stream;    // Compressor of the open section (See plf_write_payload)
 } s_plf_file_entry;
 
 
+/*
+ * Pool of file entries. Entries are allocated one by one, so pointers
+ * to them (e.g. plf_get_file_header) stay valid while the pool grows.
+ */
+typedef struct s_plf_file_pool_tag
+{
+    s_plf_file_entry**      files;        // Entries, indexed by slot
+    u32                     num_slots;    // Slots ever used (opened or in the free list)
+    u32                     max_slots;    // Allocated size of files
+    int                     free_slot;    // Head of the free list, -1 if empty
+} s_plf_file_pool;
+
+
+/*
+ * Library context (See s_plf_ctx in plf.h)
+ */
+struct s_plf_ctx_tag
+{
+    s_plf_file_pool         pool;         // Files opened in this context
+    char*                   idx_dir;      // Directory of the indexes, 0: next to the files (See plf_set_index_dir)
+};
+
+
 
 #endif /* PLF_INT_H_ */
@@ -27,6 +27,8 @@
 #define TYPES_H_
 
 /* Basic types */
+typedef unsigned long long u64;
+typedef long long s64;
 typedef unsigned int u32;
 typedef unsigned short u16;
 typedef unsigned char u8;
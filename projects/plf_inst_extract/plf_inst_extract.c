@@ -94,28 +94,21 @@ void DumpPLF(int fileidx)
 
 void ExtractInstaller(const char* filename, const char* output_file)
 {
-    int verify_result;
+    int remove_output = 0;
     int installerIdx, i, num_entries, num_entries_installer;
     int fileIdx, fileIdxInstaller, fileIdxNew;
     s_plf_file *fileHdrInstaller, *fileHdrNew, *fileHdrOld;
     s_plf_section* installerSection = 0;
-    void* buffer;
 
-    fileIdx = plf_open_file(filename);
+    fileIdx = plf_open_file_ex(filename, PLF_OPEN_MMAP);
 
     if (fileIdx < 0)
     {
-        printf("!!! plf_open_file(%s) failed: %d\n", filename, fileIdx);
+        printf("!!! plf_open_file_ex(%s) failed: %d\n", filename, fileIdx);
         return;
     }
 
-    /* Verify the file */
-    verify_result = plf_verify(fileIdx);
-
-    if (verify_result < 0)
-    {
-        printf("!!! plf_verify(%s) failed: %d\n", filename, verify_result);
-    }
+    /* The installer sections are checked while they are copied (PLF_WRITE_VERIFY_CRC) */
 
     /* Find the installer section */
     num_entries = plf_get_num_sections(fileIdx);
@@ -137,20 +130,12 @@ void ExtractInstaller(const char* filename, const char* output_file)
     /* Found the installer */
     installerIdx = i;
 
-    /* Now open the installer from RAM */
-    buffer = malloc(installerSection->dwSectionSize);
-    if (!buffer)
-    {
-        printf("!!!  unable to alloc %d bytes\n", installerSection->dwSectionSize);
-        goto ExtractInstaller_exit_1;
-    }
-    plf_get_payload_raw(fileIdx, installerIdx, buffer, 0, installerSection->dwSectionSize);
-
-    fileIdxInstaller = plf_open_ram(buffer, installerSection->dwSectionSize);
+    /* Now open the installer inside the file */
+    fileIdxInstaller = plf_open_section(fileIdx, installerIdx);
     if (fileIdxInstaller < 0)
     {
-        printf("!!! plf_open_ram for installer failed: %d\n", fileIdxInstaller);
-        goto ExtractInstaller_exit_2;
+        printf("!!! plf_open_section for installer failed: %d\n", fileIdxInstaller);
+        goto ExtractInstaller_exit_1;
     }
 
 
@@ -194,66 +179,80 @@ void ExtractInstaller(const char* filename, const char* output_file)
 
     for (i = 0; i < num_entries_installer; ++i)
     {
-        s_plf_section* newSection;
+        s_plf_section newSection;
+        struct iovec payload;
+        const void* view = 0;
+        u32 view_len;
+        u32 write_flags = 0;
+        int newSectIdx;
         s_plf_section* curSection = plf_get_section_header(fileIdxInstaller, i);
 
-        int newSectIdx = plf_begin_section(fileIdxNew);
-        if (newSectIdx < 0)
-        {
-            printf("!!! plf_begin_section failed: %d\n", newSectIdx);
-            goto ExtractInstaller_exit_4;
-        }
-
-        printf("*** Processing section: %d\n", newSectIdx);
-        newSection = plf_get_section_header(fileIdxNew, newSectIdx);
+        printf("*** Processing section: %d\n", i);
 
         /* Copy hdr */
-        newSection->dwSectionType = curSection->dwSectionType;
-        newSection->dwUncomprSize = curSection->dwUncomprSize;
+        newSection.dwSectionType = curSection->dwSectionType;
+        newSection.dwUncomprSize = curSection->dwUncomprSize;
 
         /* Add 16MB space at the beginning of RAM */
-        newSection->dwLoadAddr = curSection->dwLoadAddr + 0x1000000;
+        newSection.dwLoadAddr = curSection->dwLoadAddr + 0x1000000;
         printf("    Changing section %d load addr from 0x%08x to 0x%08x\n",
-                newSectIdx,
+                i,
                 curSection->dwLoadAddr ,
-                newSection->dwLoadAddr);
+                newSection.dwLoadAddr);
 
         /* Copy content */
         if (curSection->dwSectionType != 0x7)
         {
-            u32 bytes_count = 0;
-            u8* copy_buf = (u8*)malloc(0x1000);
-
-            printf("    Copy section %d (%d bytes)\n", newSectIdx, curSection->dwSectionSize);
-            while (bytes_count < curSection->dwSectionSize)
+            int view_res = plf_get_payload_view(fileIdxInstaller, i, &view, &view_len);
+            if (view_res < 0)
             {
-                int bytes_copied;
-
-                /* Read */
-                bytes_copied = plf_get_payload_raw(fileIdxInstaller, i, copy_buf, bytes_count, 0x1000);
+                printf("!!! plf_get_payload_view failed: %d\n", view_res);
+                remove_output = 1;
+                goto ExtractInstaller_exit_4;
+            }
 
-                /* Write */
-                plf_write_payload(fileIdxNew, newSectIdx, copy_buf, bytes_copied, 0);
+            printf("    Copy section %d (%d bytes)\n", i, curSection->dwSectionSize);
+            payload.iov_base = (void*) view;
+            payload.iov_len = view_len;
 
-                bytes_count += bytes_copied;
-            }
-            free(copy_buf);
+            /* Unchanged content, checked against its CRC in the same pass */
+            newSection.dwCRC32 = curSection->dwCRC32;
+            write_flags = PLF_WRITE_VERIFY_CRC;
         }
         else
         {
             /* Modify boot params */
-            printf("    Modify boot params in section %d\n", newSectIdx);
-            plf_write_payload(fileIdxNew, newSectIdx, boot_params, strlen(boot_params)+1, 0);
+            printf("    Modify boot params in section %d\n", i);
+            payload.iov_base = (void*) boot_params;
+            payload.iov_len = strlen(boot_params)+1;
         }
 
-        plf_finish_section(fileIdxNew, newSectIdx);
+        /* Header, content and padding at once */
+        newSectIdx = plf_write_section_ex(fileIdxNew, &newSection, &payload, 1, write_flags);
+
+        if (view != 0)
+            plf_release_payload_view(fileIdxInstaller, view);
+
+        if (newSectIdx == PLF_E_CRC)
+        {
+            printf("!!! section %d of the installer is damaged (CRC)\n", i);
+            remove_output = 1;
+            goto ExtractInstaller_exit_4;
+        }
+
+        if (newSectIdx < 0)
+        {
+            printf("!!! plf_write_section failed: %d\n", newSectIdx);
+            remove_output = 1;
+            goto ExtractInstaller_exit_4;
+        }
 
         printf("\n");
     }
 
     /* Close & open again */
     plf_close(fileIdxNew);
-    fileIdxNew = plf_open_file(output_file);
+    fileIdxNew = plf_open_file_ex(output_file, PLF_OPEN_MMAP);
 
     int verify_res = plf_verify(fileIdxNew);
 
@@ -273,12 +272,15 @@ void ExtractInstaller(const char* filename, const char* output_file)
 ExtractInstaller_exit_4:
     plf_close(fileIdxNew);
 
+    if (remove_output)
+    {
+        printf("*** FAILED --> %s removed ***\n", output_file);
+        unlink(output_file);
+    }
+
 ExtractInstaller_exit_3:
     plf_close(fileIdxInstaller);
 
-ExtractInstaller_exit_2:
-    free(buffer);
-
 ExtractInstaller_exit_1:
     plf_close(fileIdx);
 
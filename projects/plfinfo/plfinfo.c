@@ -33,6 +33,7 @@
 int verbose = 0;
 int segments = 0;
 int debug = 0;
+int use_index = 0;
 const char* input_file_name =0;
 
 const char boot_params_default[] = "parrotparts=nand0:256K(Pbootloader),8M(Pmain_boot),8M(Pfactory),16M(Psystem),98048K(Pupdate) "
@@ -53,6 +54,8 @@ static const struct option long_options[] =
         { "help", no_argument, 0, 'h' },
         { "segments", no_argument, 0, 's' },
         { "verbose", no_argument, 0, 'v' },
+        { "index", no_argument, 0, 'I' },
+        { "index-dir", required_argument, 0, 'D' },
         { 0, 0, 0, 0 }
 };
 
@@ -97,32 +100,41 @@ void DumpPLF(int fileidx)
 void FileInfo(const char* filename)
 {
     int verify_result;
+    int* verify_results;
     int installerIdx, i, num_entries;
     int fileIdx, fileIdxInstaller;
     s_plf_file *fileHdrInstaller;
     s_plf_section* installerSection = 0;
-    void* buffer;
 
-    fileIdx = plf_open_file(filename);
+    fileIdx = plf_open_file_ex(filename, PLF_OPEN_MMAP | (use_index ? PLF_OPEN_INDEX : 0));
 
     DumpPLF(fileIdx);
 
     if (fileIdx < 0)
     {
-        printf("!!! plf_open_file(%s) failed: %d\n", filename, fileIdx);
+        printf("!!! plf_open_file_ex(%s) failed: %d\n", filename, fileIdx);
         return;
     }
 
-    /* Verify the file */
-    verify_result = plf_verify(fileIdx);
+    /* Verify the file, reporting every bad section */
+    num_entries = plf_get_num_sections(fileIdx);
+    verify_results = (num_entries > 0) ? (int*) calloc(num_entries, sizeof(int)) : 0;
+    verify_result = plf_verify_parallel(fileIdx, 0, verify_results);
 
     if (verify_result < 0)
     {
         printf("!!! plf_verify(%s) failed: %d\n", filename, verify_result);
+
+        for (i = 0; verify_results != 0 && i < num_entries; ++i)
+        {
+            if (verify_results[i] < 0)
+                printf("!!! section %d is bad: %d\n", i, verify_results[i]);
+        }
     }
 
+    free(verify_results);
+
     /* Find the installer section */
-    num_entries = plf_get_num_sections(fileIdx);
 
     for(i = 0; i < num_entries; ++i)
     {
@@ -141,28 +153,19 @@ void FileInfo(const char* filename)
     /* Found the installer */
     installerIdx = i;
 
-    /* Now open the installer from RAM */
-    buffer = malloc(installerSection->dwSectionSize);
-    if (!buffer)
-    {
-        printf("!!!  unable to alloc %d bytes\n", installerSection->dwSectionSize);
-        goto FileInfo_exit_1;
-    }
-    plf_get_payload_raw(fileIdx, installerIdx, buffer, 0, installerSection->dwSectionSize);
-
-    fileIdxInstaller = plf_open_ram(buffer, installerSection->dwSectionSize);
+    /* Now open the installer inside the file */
+    fileIdxInstaller = plf_open_section(fileIdx, installerIdx);
     if (fileIdxInstaller < 0)
     {
-        printf("!!! plf_open_ram for installer failed: %d\n", fileIdxInstaller);
-        goto FileInfo_exit_2;
+        printf("!!! plf_open_section for installer failed: %d\n", fileIdxInstaller);
+        goto FileInfo_exit_1;
     }
 
 
     fileHdrInstaller = plf_get_file_header(fileIdxInstaller);
     printf("*** Installer found! Version: %d.%d.%d ***\n", fileHdrInstaller->dwVersionMajor, fileHdrInstaller->dwVersionMinor, fileHdrInstaller->dwVersionBugfix);
 
-FileInfo_exit_2:
-    free(buffer);
+    plf_close(fileIdxInstaller);
 
 FileInfo_exit_1:
     plf_close(fileIdx);
@@ -171,12 +174,14 @@ FileInfo_exit_1:
 
 void print_help(const char* name)
 {
-    printf("usage: %s [-h] [-s] [-v] -i <updater_file>\n", name);
+    printf("usage: %s [-h] [-s] [-v] [-I] [-D <dir>] -i <updater_file>\n", name);
 
     printf("%-40s %s\n", "-h, --help",                      "Print this information");
     printf("%-40s %s\n", "-i, --input-file <input_file>",   "Input file name");
     printf("%-40s %s\n", "-s, --segments",   "Show segments");
     printf("%-40s %s\n", "-v, --verbose",   "Verbose mode");
+    printf("%-40s %s\n", "-I, --index",   "Use and update the index <input_file>.plfidx");
+    printf("%-40s %s\n", "-D, --index-dir <dir>",   "Use and update the index in <dir>");
 
     printf("\n\n");
 
@@ -190,7 +195,7 @@ int parse_options(int argc, char** argv)
     while(1)
     {
         int option_index;
-        int result = getopt_long(argc, argv, "i:hsv", long_options, &option_index);
+        int result = getopt_long(argc, argv, "i:hsvID:", long_options, &option_index);
 
         if (result < 0)
             return 0;
@@ -214,6 +219,16 @@ int parse_options(int argc, char** argv)
             verbose = 1;
             break;
 
+        case 'I':
+            use_index = 1;
+            break;
+
+        case 'D':
+            if (plf_set_index_dir(optarg) < 0)
+                return -1;
+            use_index = 1;
+            break;
+
         }
 
 
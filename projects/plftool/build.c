@@ -51,6 +51,7 @@ typedef struct s_exec_sect_config_tag
 {
     const char* input_file;
     u32 load_addr;
+    int compress;
 } s_exec_sect_config;
 
 typedef struct s_kernel_config_tag
@@ -80,6 +81,9 @@ typedef struct s_kernel_config_tag
 
 } s_kernel_config;
 
+/*
+ * Returns -1 if the section is missing, -2 if it is invalid
+ */
 int read_exec_sect_config(s_exec_sect_config* cfg, const s_ini_handle* ini_file, const char* sect_name)
 {
     const s_ini_section* ini_sect;
@@ -88,6 +92,7 @@ int read_exec_sect_config(s_exec_sect_config* cfg, const s_ini_handle* ini_file,
 
     cfg->input_file = 0;
     cfg->load_addr = 0;
+    cfg->compress = 0;
 
     ini_sect = ini_get_section(ini_file, sect_name );
     if (!ini_sect)
@@ -95,6 +100,13 @@ int read_exec_sect_config(s_exec_sect_config* cfg, const s_ini_handle* ini_file,
 
     cfg->input_file = ini_get_string(ini_file, "file", ini_sect, 0);
     cfg->load_addr = ini_get_int(ini_file, "LoadAddr", ini_sect, 0);
+    cfg->compress = ini_get_int(ini_file, "Compress", ini_sect, 0);    /* gzip level, 0: stored as is */
+
+    if (cfg->compress < 0 || cfg->compress > 9)
+    {
+        printf("!!! invalid Compress=%d in [%s], allowed: 0 (not compressed) to 9\n", cfg->compress, sect_name);
+        return -2;
+    }
 
     return 0;
 }
@@ -105,6 +117,7 @@ int write_plf_exec_sect(const s_exec_sect_config* cfg, int fileIdx, int type)
     FILE * fp;
     s_plf_section* sect;
     int bytes_read;
+    int ret_val = 0;
     void* buffer;
     if (cfg == 0 || fileIdx < 0)
         return -1;
@@ -145,17 +158,27 @@ int write_plf_exec_sect(const s_exec_sect_config* cfg, int fileIdx, int type)
 
         if (bytes_read > 0)
         {
-            plf_write_payload(fileIdx, sectIdx, buffer, bytes_read, 0); /* ##TBD Compression */
+            ret_val = plf_write_payload(fileIdx, sectIdx, buffer, bytes_read, (u8) cfg->compress);
+            if (ret_val < 0)
+            {
+                printf("!!! plf_write_payload failed (%d)\n", ret_val);
+                break;
+            }
         }
     } while(bytes_read > 0);
 
     free(buffer);
 
-    plf_finish_section(fileIdx, sectIdx);
+    if (ret_val >= 0)
+    {
+        ret_val = plf_finish_section(fileIdx, sectIdx);
+        if (ret_val < 0)
+            printf("!!! plf_finish_section failed (%d)\n", ret_val);
+    }
 
     fclose(fp);
 
-    return 0;
+    return (ret_val < 0) ? -1 : 0;
 
 }
 
@@ -194,6 +217,8 @@ int build_kernel(const s_ini_handle* ini_file)
     int plf_file_idx;
     s_plf_file* plf_file_hdr;
     int tmp_val;
+    int i, num_sections;
+    int* verify_results;
     /* const s_ini_parameter* ini_parm; */
 
     /* Collect configuration */
@@ -211,24 +236,33 @@ int build_kernel(const s_ini_handle* ini_file)
     kernel.lang_zone = ini_get_int(ini_file, "languagezone", ini_sect, 0);
 
     /* 2. Section zImage */
-    if (read_exec_sect_config(&(kernel.zImage), ini_file, "zImage") != 0)
+    tmp_val = read_exec_sect_config(&(kernel.zImage), ini_file, "zImage");
+    if (tmp_val != 0)
     {
-        printf("Section zImage not found!\n");
+        if (tmp_val == -1)
+            printf("Section zImage not found!\n");
         return -1;
     }
 
     /* 3. Section boot params */
-    if (read_exec_sect_config(&(kernel.bootparams), ini_file, "bootparams") != 0)
+    tmp_val = read_exec_sect_config(&(kernel.bootparams), ini_file, "bootparams");
+    if (tmp_val != 0)
     {
-        printf("Section bootparams not found!\n");
+        if (tmp_val == -1)
+            printf("Section bootparams not found!\n");
         return -1;
     }
 
     /* 4. Section initrd (optional) */
-    if (read_exec_sect_config(&(kernel.initrd), ini_file, "initrd") == 0)
+    tmp_val = read_exec_sect_config(&(kernel.initrd), ini_file, "initrd");
+    if (tmp_val == 0)
     {
         has_init_rd = 1;
     }
+    else if (tmp_val != -1)
+    {
+        return -1;
+    }
 
     if (verify_kernel_config(&kernel) < 0)
     {
@@ -304,15 +338,27 @@ int build_kernel(const s_ini_handle* ini_file)
     plf_close(plf_file_idx);
 
     /* Verify */
-    plf_file_idx = plf_open_file(command_args.output);
-    tmp_val = plf_verify(plf_file_idx);
+    plf_file_idx = plf_open_file_ex(command_args.output, PLF_OPEN_MMAP);
+    num_sections = plf_get_num_sections(plf_file_idx);
+    verify_results = (num_sections > 0) ? (int*) calloc(num_sections, sizeof(int)) : 0;
+    tmp_val = plf_verify_parallel(plf_file_idx, 0, verify_results);
     plf_close(plf_file_idx);
     if (tmp_val < 0)
     {
         printf("plf_verify failed: %d\n", tmp_val);
+
+        for (i = 0; verify_results != 0 && i < num_sections; ++i)
+        {
+            if (verify_results[i] < 0)
+                printf("!!! section %d is bad: %d\n", i, verify_results[i]);
+        }
+
+        free(verify_results);
         return -1;
     }
 
+    free(verify_results);
+
 
     return 0;
 }
@@ -56,6 +56,11 @@ static const struct option long_options[] =
         { "extract", required_argument, 0, 'x' },
         { "build", required_argument, 0, 'b' },
         { "replace", required_argument, 0, 'r' },
+        { "nested", required_argument, 0, 'N' },
+        { "trust-crc", no_argument, 0, 'T' },
+        { "verify", no_argument, 0, 'V' },
+        { "patch", required_argument, 0, 'P' },
+        { "offset", required_argument, 0, 'O' },
         { 0, 0, 0, 0 }
 };
 
@@ -126,11 +131,16 @@ s_command_args command_args =
         .output = 0,
         .section = -1,
         .section_type = -1,
+        .nested = -1,
         .verbose = 0,
+        .trust_crc = 0,
+        .verify = 0,
         .action = ACTION_NONE,
         .extract_type = EXTRACT_TYPE_RAW,
         .build_file = 0,
-        .replace_file = 0
+        .replace_file = 0,
+        .patch_file = 0,
+        .patch_offset = 0
 };
 
 int make_dir(const char* path, u32 umask)
@@ -144,19 +154,27 @@ int make_dir(const char* path, u32 umask)
 #endif
 }
 
-int write_file(const char* path, const void* data, u32 len, u32 umask)
+int open_file(const char* path, u32 umask)
 {
-    int fi, retval;
-    if (path == 0 || data == 0)
+    if (path == 0)
         return -1;
 
     if (umask == 0)
         umask = 0644;
 #ifdef __WIN32__
-    fi = open(path,  O_WRONLY | O_CREAT | O_BINARY, umask);
+    return open(path,  O_WRONLY | O_CREAT | O_BINARY, umask);
 #else
-    fi = open(path,  O_WRONLY | O_CREAT, umask);
+    return open(path,  O_WRONLY | O_CREAT, umask);
 #endif
+}
+
+int write_file(const char* path, const void* data, u32 len, u32 umask)
+{
+    int fi, retval;
+    if (path == 0 || data == 0)
+        return -1;
+
+    fi = open_file(path, umask);
 
     if (fi >= 0)
     {
@@ -232,6 +250,52 @@ int write_file_out(const char* path, const void* data, u32 len, u32 umask)
     return ret_val;
 }
 
+/* Path of an output file, free() it */
+char* get_path_out(const char* path)
+{
+    char* buffer;
+
+    if (command_args.output == 0)
+        return strdup(path);
+
+    buffer = (char*)malloc(strlen(command_args.output) + strlen(path) + 10);
+
+    if (buffer != 0)
+        sprintf(buffer, "%s/%s", command_args.output, path);
+
+    return buffer;
+}
+
+int open_file_out(const char* path, u32 umask)
+{
+    int ret_val;
+    char* path_out;
+
+    if (path == 0)
+        return -1;
+
+    path_out = get_path_out(path);
+    ret_val = open_file(path_out, umask);
+    free(path_out);
+
+    return ret_val;
+}
+
+int remove_file_out(const char* path)
+{
+    int ret_val;
+    char* path_out;
+
+    if (path == 0)
+        return -1;
+
+    path_out = get_path_out(path);
+    ret_val = (path_out != 0) ? unlink(path_out) : -1;
+    free(path_out);
+
+    return ret_val;
+}
+
 int parse_options(int argc, char** argv)
 {
     if (argc < 2)
@@ -240,7 +304,7 @@ int parse_options(int argc, char** argv)
     while(1)
     {
         int option_index;
-        int result = getopt_long(argc, argv, "o:i:t:n:hvde:b:r:", long_options, &option_index);
+        int result = getopt_long(argc, argv, "o:i:t:n:hvde:b:r:N:TVP:O:", long_options, &option_index);
 
         if (result < 0)
             return 0;
@@ -273,6 +337,18 @@ int parse_options(int argc, char** argv)
             command_args.section = atoi(optarg);
             break;
 
+        case 'N':
+            command_args.nested = atoi(optarg);
+            break;
+
+        case 'T':
+            command_args.trust_crc = 1;
+            break;
+
+        case 'V':
+            command_args.verify = 1;
+            break;
+
         case 'e':
             command_args.action = ACTION_EXTRACT;
             if ( stricmp(optarg, "raw") == 0)
@@ -305,6 +381,15 @@ int parse_options(int argc, char** argv)
             command_args.replace_file = optarg;
             break;
 
+        case 'P':
+            command_args.action = ACTION_PATCH;
+            command_args.patch_file = optarg;
+            break;
+
+        case 'O':
+            command_args.patch_offset = strtoul(optarg, 0, 0);
+            break;
+
         }
 
 
@@ -317,12 +402,66 @@ void print_help()
 {
     printf("Usage: plftool [-d][-e] [OPTIONS]\n");
 
+    printf("%-40s %s\n", "-h, --help",                       "Print this information");
+    printf("%-40s %s\n", "-i, --input-file <file>",          "Input file name");
+    printf("%-40s %s\n", "-o, --output <path>",              "Output file or directory");
+    printf("%-40s %s\n", "-d, --dump",                       "Dump the headers of the input file");
+    printf("%-40s %s\n", "-e <raw|nice>",                    "Extract sections");
+    printf("%-40s %s\n", "-V, --verify",                     "Raw extraction: check the CRC of every section, a file");
+    printf("%-40s %s\n", "",                                 "with a CRC error is removed (compressed: not written)");
+    printf("%-40s %s\n", "-n, --section <idx>",              "Only this section");
+    printf("%-40s %s\n", "-t, --section-type <type>",        "Only sections of this type");
+    printf("%-40s %s\n", "-N, --nested <idx>",               "Work on the PLF file stored in this section");
+    printf("%-40s %s\n", "-T, --trust-crc",                  "Replace: keep the CRC of unchanged sections as stored,");
+    printf("%-40s %s\n", "",                                 "without recomputing it");
+    printf("%-40s %s\n", "-b, --build <ini_file>",           "Build a PLF file");
+    printf("%-40s %s\n", "-r, --replace <file>",             "Replace the content of a section (-n)");
+    printf("%-40s %s\n", "-P, --patch <file>",               "Overwrite part of a section (-n) in place");
+    printf("%-40s %s\n", "-O, --offset <offset>",            "Position of the patch in the section");
+    printf("%-40s %s\n", "-v, --verbose",                    "Verbose mode");
+
+    printf("\n\n");
+}
+
+
+/*
+ * Open the input file. With --nested the PLF file in that section of the
+ * input file is opened instead and parentidx gets the input file.
+ */
+int open_input(int* parentidx)
+{
+    int fileidx = plf_open_file_ex(command_args.input_file, PLF_OPEN_MMAP | PLF_OPEN_LAZY);
+
+    *parentidx = -1;
+
+    if (fileidx < 0 || command_args.nested < 0)
+        return fileidx;
+
+    *parentidx = fileidx;
+    fileidx = plf_open_section(*parentidx, command_args.nested);
+
+    if (fileidx < 0)
+    {
+        printf("!!! section %d of %s is no PLF file\n", command_args.nested, command_args.input_file);
+        plf_close(*parentidx);
+        *parentidx = -1;
+    }
+
+    return fileidx;
+}
+
+void close_input(int fileidx, int parentidx)
+{
+    plf_close(fileidx);
+
+    if (parentidx >= 0)
+        plf_close(parentidx);
 }
 
 
 int do_dump()
 {
-    int i, num_sections, fileidx, section_start, section_end;
+    int i, num_sections, fileidx, parentidx, section_start, section_end;
     s_plf_file* header;
 
     if (command_args.input_file == 0)
@@ -332,7 +471,7 @@ int do_dump()
     }
 
     /* Open the file */
-    fileidx = plf_open_file(command_args.input_file);
+    fileidx = open_input(&parentidx);
     if (fileidx < 0)
     {
         printf("!!! unable to open %s\n", command_args.input_file);
@@ -389,7 +528,7 @@ int do_dump()
 
     printf("*** END OF DUMP ***\n\n");
 
-    plf_close(fileidx);
+    close_input(fileidx, parentidx);
 
     return 0;
 }
@@ -412,7 +551,7 @@ int do_extract_section_nice(int fileidx, int sectionidx)
 
 int do_extract()
 {
-    int i, num_sections, fileidx, section_start, section_end;
+    int i, num_sections, fileidx, parentidx, section_start, section_end;
     int file_type = 0;
     s_plf_file* header;
 
@@ -429,7 +568,7 @@ int do_extract()
     }
 
     /* Open the file */
-    fileidx = plf_open_file(command_args.input_file);
+    fileidx = open_input(&parentidx);
     if (fileidx < 0)
     {
         printf("!!! unable to open %s\n", command_args.input_file);
@@ -443,15 +582,18 @@ int do_extract()
         file_type = 0;
 
 
-    num_sections = plf_get_num_sections(fileidx);
-    section_start = 0;
-    section_end   = num_sections;
-
     if (command_args.section >= 0)
     {
+        /* Only the sections up to the wanted one are read */
         section_start = command_args.section;
         section_end   = command_args.section+1;
     }
+    else
+    {
+        num_sections = plf_get_num_sections(fileidx);
+        section_start = 0;
+        section_end   = num_sections;
+    }
 
     make_dir(command_args.output, 0644);
 
@@ -463,6 +605,12 @@ int do_extract()
         u32 buffer_size;
         s_plf_section* section = plf_get_section_header(fileidx, i);
 
+        if (section == 0)
+        {
+            printf("!!! no section %d in %s\n", i, command_args.input_file);
+            break;
+        }
+
         /* Skip not wanted section types */
         if (command_args.section_type >= 0 && section->dwSectionType != command_args.section_type )
             continue;
@@ -483,9 +631,42 @@ int do_extract()
                 (section->dwUncomprSize!=0?1:0),
                 section_type_fmt);
 
-        if (command_args.extract_type == EXTRACT_TYPE_RAW)
+        if (command_args.extract_type == EXTRACT_TYPE_RAW && section->dwUncomprSize == 0)
+        {
+            /* Straight from the file, without a copy in memory, with --verify checked on the way */
+            int fi = open_file_out(section_type_name, 0);
+            s64 extract_res = PLF_E_IO;
+
+            printf("dumping section %d (%s)\n", i, section_type_name);
+
+            if (fi >= 0)
+            {
+                extract_res = plf_extract_section_to_fd_ex(fileidx, i, fi,
+                        command_args.verify ? PLF_WRITE_VERIFY_CRC : 0);
+                close(fi);
+            }
+
+            if (extract_res == PLF_E_CRC)
+            {
+                printf("!!! section %d has a bad CRC, %s removed\n", i, section_type_name);
+                remove_file_out(section_type_name);
+            }
+            else if (extract_res < 0)
+            {
+                printf("!!! unable to write section %d to %s\n", i, section_type_name);
+            }
+        }
+        else if (command_args.extract_type == EXTRACT_TYPE_RAW)
         {
             printf("dumping section %d (%s)\n", i, section_type_name);
+
+            /* The CRC covers the compressed data */
+            if (command_args.verify && plf_check_crc(fileidx, i) < 0)
+            {
+                printf("!!! section %d has a bad CRC, %s not written\n", i, section_type_name);
+                continue;
+            }
+
             plf_get_payload_uncompressed(fileidx, i, &buffer, &buffer_size);
 
             write_file_out(section_type_name, buffer, buffer_size, 0);
@@ -497,6 +678,8 @@ int do_extract()
         }
     }
 
+    close_input(fileidx, parentidx);
+
     return 0;
 }
 
@@ -533,6 +716,10 @@ int main(int argc, char** argv)
         ret_val = replace();
         break;
 
+    case ACTION_PATCH:
+        ret_val = patch();
+        break;
+
     default:
         printf("No or wrong action specified!\n");
         ret_val = -1;
@@ -31,18 +31,24 @@ typedef struct s_command_args_tag
     const char* output;
     int section;
     int section_type;
+    int nested;
     u8  verbose;
+    u8  trust_crc;
+    u8  verify;
     u32 action;
 #define ACTION_NONE    0
 #define ACTION_EXTRACT 1
 #define ACTION_DUMP    2
 #define ACTION_BUILD   3
 #define ACTION_REPLACE 4
+#define ACTION_PATCH   5
     u32 extract_type;
 #define EXTRACT_TYPE_NICE 0
 #define EXTRACT_TYPE_RAW  1
     const char* build_file;
     const char* replace_file;
+    const char* patch_file;
+    u32 patch_offset;
 } s_command_args;
 
 extern s_command_args command_args;
@@ -56,11 +56,11 @@ int do_replace()
         return -1;
     }
 
-    /* Open input plf */
-    fidx_input = plf_open_file(command_args.input_file);
+    /* Open input plf, not mapped: unchanged sections are copied by the kernel */
+    fidx_input = plf_open_file_ex(command_args.input_file, 0);
     if (fidx_input < 0)
     {
-        printf("plf_open_file(%s) failed: %d\n", command_args.input_file, fidx_input);
+        printf("plf_open_file_ex(%s) failed: %d\n", command_args.input_file, fidx_input);
         fclose(replace_file);
         return -1;
     }
@@ -99,8 +99,32 @@ int do_replace()
     {
         s_plf_section* newSection;
         s_plf_section* curSection = plf_get_section_header(fidx_input, i);
+        int newSectIdx;
+        u32 bytes_read = 0;
 
-        int newSectIdx = plf_begin_section(fidx_output);
+        if (i != command_args.section)
+        {
+            /* Copy section */
+            printf("*** Processing section: %03d: ", i);
+            printf("    Copy section (%d bytes)\n", curSection->dwSectionSize);
+
+            /* Checksums of the input are only computed again without --trust-crc */
+            newSectIdx = plf_copy_section_ex(fidx_input, i, fidx_output,
+                    command_args.trust_crc ? PLF_WRITE_KEEP_CRC : 0);
+            if (newSectIdx < 0)
+            {
+                printf("!!! plf_copy_section failed: %d\n", newSectIdx);
+                fclose(replace_file);
+                plf_close(fidx_input);
+                plf_close(fidx_output);
+                free(tmp_buf);
+                return -1;
+            }
+
+            continue;
+        }
+
+        newSectIdx = plf_begin_section(fidx_output);
         if (newSectIdx < 0)
         {
             printf("!!! plf_begin_section failed: %d\n", newSectIdx);
@@ -119,42 +143,17 @@ int do_replace()
         newSection->dwUncomprSize = curSection->dwUncomprSize;
         newSection->dwLoadAddr    = curSection->dwLoadAddr;
 
-        if (i != command_args.section)
-        {
-            /* Copy content */
-            u32 bytes_count = 0;
-
-            printf("    Copy section (%d bytes)", curSection->dwSectionSize);
-            while (bytes_count < curSection->dwSectionSize)
-            {
-                int bytes_copied;
-
-                /* Read */
-                bytes_copied = plf_get_payload_raw(fidx_input, i, tmp_buf, bytes_count, 0x1000);
-
-                /* Write */
-                plf_write_payload(fidx_output, newSectIdx, tmp_buf, bytes_copied, 0);
-
-                bytes_count += bytes_copied;
-            }
-        }
-        else
+        /* Replace section */
+        printf("    Replace section with content of %s", command_args.replace_file);
+        do
         {
-            /* Replace section */
-            u32 bytes_read = 0;
-
-            printf("    Replace section with content of %s", command_args.replace_file);
-            do
-            {
-                bytes_read = fread(tmp_buf, 1, 0x1000, replace_file);
+            bytes_read = fread(tmp_buf, 1, 0x1000, replace_file);
 
-                if (bytes_read > 0)
-                    plf_write_payload(fidx_output, newSectIdx, tmp_buf, bytes_read, 0);
+            if (bytes_read > 0)
+                plf_write_payload(fidx_output, newSectIdx, tmp_buf, bytes_read, 0);
 
-            } while (bytes_read > 0);
-            ret_val = 1;
-
-        }
+        } while (bytes_read > 0);
+        ret_val = 1;
 
         plf_finish_section(fidx_output, newSectIdx);
 
@@ -211,3 +210,71 @@ int replace(void)
     return do_replace();
 }
 
+/*
+ * Overwrite bytes of a section in place with the content of the patch file.
+ * Only the patched bytes are read for the new CRC, not the whole section.
+ */
+int patch(void)
+{
+    FILE* patch_file;
+    void* patch_buf;
+    long patch_len;
+    int fidx, ret_val;
+
+    if (command_args.section < 0)
+    {
+        printf("!!! no section to patch specified\n");
+        return -1;
+    }
+
+    if (command_args.input_file == 0)
+    {
+        printf("!!! no input file specified\n");
+        return -1;
+    }
+
+    patch_file = fopen(command_args.patch_file, "rb");
+
+    if (patch_file == 0)
+    {
+        printf("!!! unable to open patch file %s\n", command_args.patch_file);
+        return -1;
+    }
+
+    fseek(patch_file, 0, SEEK_END);
+    patch_len = ftell(patch_file);
+    fseek(patch_file, 0, SEEK_SET);
+
+    patch_buf = malloc(patch_len > 0 ? patch_len : 1);
+
+    if (patch_len < 0 || patch_buf == 0 || fread(patch_buf, 1, patch_len, patch_file) != patch_len)
+    {
+        printf("!!! unable to read patch file %s\n", command_args.patch_file);
+        fclose(patch_file);
+        free(patch_buf);
+        return -1;
+    }
+
+    fclose(patch_file);
+
+    fidx = plf_open_file_ex(command_args.input_file, PLF_OPEN_PATCH);
+
+    if (fidx < 0)
+    {
+        printf("plf_open_file_ex(%s) failed: %d\n", command_args.input_file, fidx);
+        free(patch_buf);
+        return -1;
+    }
+
+    ret_val = plf_patch_payload(fidx, command_args.section, command_args.patch_offset, patch_buf, patch_len);
+
+    if (ret_val < 0)
+        printf("!!! unable to patch section %d at 0x%x: %d\n", command_args.section, command_args.patch_offset, ret_val);
+    else
+        printf("patched %ld bytes of section %d at 0x%x\n", patch_len, command_args.section, command_args.patch_offset);
+
+    plf_close(fidx);
+    free(patch_buf);
+
+    return (ret_val < 0) ? -1 : 0;
+}
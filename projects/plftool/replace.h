@@ -26,5 +26,6 @@
 #include "plftool.h"
 
 int replace(void);
+int patch(void);
 
 #endif /* REPLACE_H_ */
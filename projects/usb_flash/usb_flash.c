@@ -22,6 +22,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <usb.h>
 #include <getopt.h>
 #include "plf.h"
@@ -43,6 +44,7 @@ static const struct option long_options[] =
 {
         { "help", no_argument, 0, 'h' },
         { "kernel-test", required_argument, 0, 't' },
+        { "index-dir", required_argument, 0, 'I' },
         { 0, 0, 0, 0 }
 };
 
@@ -54,6 +56,7 @@ typedef struct s_command_args_tag
     const char* bootloader_file;
     const char* installer_file;
     const char* payload_file;
+    u32 open_flags;
 } s_command_args;
 
 s_command_args command_args =
@@ -61,7 +64,8 @@ s_command_args command_args =
         .mode = MODE_FLASH,
         .bootloader_file = "ardrone_usb_bootloader.bin",
         .installer_file = "ardrone_installer.plf",
-        .payload_file = "ardrone_update.plf"
+        .payload_file = "ardrone_update.plf",
+        .open_flags = PLF_OPEN_MMAP
 };
 
 int start_usb(int* p_interface, usb_dev_handle** p_dev_handle)
@@ -225,7 +229,7 @@ int parse_options(int argc, char** argv)
     while(1)
     {
         int option_index;
-        int result = getopt_long(argc, argv, "t:h", long_options, &option_index);
+        int result = getopt_long(argc, argv, "t:hI:", long_options, &option_index);
 
         if (result < 0)
             return 0;
@@ -243,6 +247,13 @@ int parse_options(int argc, char** argv)
             command_args.installer_file = optarg;
             break;
 
+        case 'I':
+            /* Files verified before are not read again */
+            if (plf_set_index_dir(optarg) < 0)
+                return -1;
+            command_args.open_flags |= PLF_OPEN_INDEX;
+            break;
+
         }
 
 
@@ -444,22 +455,35 @@ int verify_file(const char* filename, int plf_type)
     printf("Verifying %s\n", filename);
     if (plf_type != 0)
     {
-        int ret_val;
-        int fileIdx = plf_open_file(filename);
+        int ret_val, i, num_sections;
+        int* verify_results;
+        int fileIdx = plf_open_file_ex(filename, command_args.open_flags);
 
         if (fileIdx < 0)
         {
             printf("!!! unable to open %s\nPlease verify that this file is available! (%d)\n", filename, fileIdx);
             return -1;
         }
-        ret_val = plf_verify(fileIdx);
+        num_sections = plf_get_num_sections(fileIdx);
+        verify_results = (num_sections > 0) ? (int*) calloc(num_sections, sizeof(int)) : 0;
+        ret_val = plf_verify_parallel(fileIdx, 0, verify_results);
 
         if (ret_val < 0)
         {
             printf("!!! %s is not a valid plf file (%d)\n", filename, ret_val);
+
+            for (i = 0; verify_results != 0 && i < num_sections; ++i)
+            {
+                if (verify_results[i] < 0)
+                    printf("!!! section %d is bad: %d\n", i, verify_results[i]);
+            }
+
+            free(verify_results);
             return -1;
         }
 
+        free(verify_results);
+
         /* Check file header */
         s_plf_file* hdr = plf_get_file_header(fileIdx);
         if (hdr->dwHdrVersion < 10)